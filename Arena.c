@@ -0,0 +1,129 @@
+#include <pthread.h>
+
+#include "Arena.h"
+
+// Front-end memory is bump-allocated out of large chunks.
+// Allocations are attributed to the current phase for -mem-stats.
+//
+// There are two arenas. The permanent one holds what lives for the whole compile
+// (names, string literals, globals). The other one can be released back to a mark,
+// which is how -stream frees each function once it's been generated.
+//
+// Every thread has its own pair of arenas and its own counts, so the -j workers
+// allocate without locking. Their chunks are never freed, the ASTs they parse are
+// used by the main thread afterwards, and their counts are added to the totals by
+// MergeArenaStats.
+
+static const NUM ARENA_CHUNK_SIZE = 1 << 20;
+
+typedef struct ArenaChunk {
+  struct ArenaChunk* ChunkPrevious;
+  char* ChunkEnd;
+} ArenaChunk;
+
+typedef struct Arena {
+  ArenaChunk* ArenaChunks; // newest first
+  char* ArenaCursor;
+  char* ArenaEnd;
+} Arena;
+
+static __thread Arena FrontEndArena;
+static __thread Arena PermanentArena;
+static __thread BOOL IsPermanent;
+
+static __thread ArenaPhase CurrentPhase = PHASE_LEX;
+static __thread NUM PhaseBytes[PHASE_COUNT];
+static __thread NUM PhaseAllocations[PHASE_COUNT];
+static __thread NUM LiveBytes;         // in both arenas
+static __thread NUM FrontEndLiveBytes; // in the front-end arena, what ReleaseArena can free
+static __thread NUM PeakBytes;
+
+// Counts of the threads that have finished, see MergeArenaStats
+static pthread_mutex_t MergedLock = PTHREAD_MUTEX_INITIALIZER;
+static NUM MergedPhaseBytes[PHASE_COUNT];
+static NUM MergedPhaseAllocations[PHASE_COUNT];
+static NUM MergedPeakBytes;
+
+static const char* PhaseNames[PHASE_COUNT] = { "lex", "parse", "codegen" };
+
+void* ArenaAlloc(NUM size) {
+  Arena* arena = IsPermanent ? &PermanentArena : &FrontEndArena;
+  size         = (size + 7) & ~7;
+
+  if (arena->ArenaEnd - arena->ArenaCursor < size) {
+    NUM chunk_size    = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    ArenaChunk* chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+    if (!chunk) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    chunk->ChunkPrevious = arena->ArenaChunks;
+    arena->ArenaChunks   = chunk;
+    chunk->ChunkEnd      = (char*)(chunk + 1) + chunk_size;
+    arena->ArenaCursor   = (char*)(chunk + 1);
+    arena->ArenaEnd      = chunk->ChunkEnd;
+  }
+
+  void* ptr = arena->ArenaCursor;
+  arena->ArenaCursor += size;
+
+  PhaseBytes[CurrentPhase] += size;
+  PhaseAllocations[CurrentPhase]++;
+  LiveBytes += size;
+  if (!IsPermanent) FrontEndLiveBytes += size;
+  if (LiveBytes > PeakBytes) PeakBytes = LiveBytes;
+  return ptr;
+}
+
+// Routes ArenaAlloc to the permanent arena or back, returns the previous setting
+BOOL SetArenaPermanent(BOOL permanent) {
+  BOOL was_permanent = IsPermanent;
+  IsPermanent        = permanent;
+  return was_permanent;
+}
+
+ArenaMark MarkArena() {
+  ArenaMark mark = { FrontEndArena.ArenaChunks, FrontEndArena.ArenaCursor, FrontEndLiveBytes };
+  return mark;
+}
+
+// Frees everything allocated in the front-end arena since mark
+void ReleaseArena(ArenaMark mark) {
+  while (FrontEndArena.ArenaChunks != mark.MarkChunk) {
+    ArenaChunk* chunk         = FrontEndArena.ArenaChunks;
+    FrontEndArena.ArenaChunks = chunk->ChunkPrevious;
+    free(chunk);
+  }
+
+  FrontEndArena.ArenaCursor = mark.MarkCursor;
+  FrontEndArena.ArenaEnd    = mark.MarkChunk ? mark.MarkChunk->ChunkEnd : NULL;
+
+  // What went into the permanent arena since mark stays live
+  LiveBytes -= FrontEndLiveBytes - mark.MarkFrontEndBytes;
+  FrontEndLiveBytes = mark.MarkFrontEndBytes;
+}
+
+void SetArenaPhase(ArenaPhase phase) {
+  CurrentPhase = phase;
+}
+
+// Adds the calling thread's counts to the totals printed by PrintArenaStats.
+// Everything a thread allocated stays live, so its peak is added as well,
+// which makes the peak an upper bound with -j.
+void MergeArenaStats() {
+  pthread_mutex_lock(&MergedLock);
+  for (NUM i = 0; i < PHASE_COUNT; i++) {
+    MergedPhaseBytes[i] += PhaseBytes[i];
+    MergedPhaseAllocations[i] += PhaseAllocations[i];
+  }
+  MergedPeakBytes += PeakBytes;
+  pthread_mutex_unlock(&MergedLock);
+}
+
+void PrintArenaStats() {
+  for (NUM i = 0; i < PHASE_COUNT; i++) {
+    fprintf(stderr, "%-8s %10ld bytes in %8ld allocations\n", PhaseNames[i], PhaseBytes[i] + MergedPhaseBytes[i],
+            PhaseAllocations[i] + MergedPhaseAllocations[i]);
+  }
+  fprintf(stderr, "%-8s %10ld bytes live at once\n", "peak", PeakBytes + MergedPeakBytes);
+}
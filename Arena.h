@@ -0,0 +1,26 @@
+#pragma once
+#include "Common.h"
+
+enum ArenaPhaseEnum {
+  PHASE_LEX = 0,
+  PHASE_PARSE = 1,
+  PHASE_CODEGEN = 2,
+
+  PHASE_COUNT,
+};
+typedef NUM ArenaPhase;
+
+// A point in the front-end arena that ReleaseArena can go back to
+typedef struct ArenaMark {
+  struct ArenaChunk* MarkChunk;
+  char* MarkCursor;
+  NUM MarkFrontEndBytes; // live in the front-end arena
+} ArenaMark;
+
+void* ArenaAlloc(NUM size);
+BOOL SetArenaPermanent(BOOL permanent);
+ArenaMark MarkArena();
+void ReleaseArena(ArenaMark mark);
+void SetArenaPhase(ArenaPhase phase);
+void MergeArenaStats();
+void PrintArenaStats();
@@ -0,0 +1,123 @@
+#pragma once
+#include "Common.h"
+#include "Node.h"
+#include "Object.h"
+
+enum RegisterEnum {
+  REG_RAX = 0,
+  REG_RCX = 1,
+  REG_RDX = 2,
+  REG_RBX = 3,
+  REG_RSP = 4,
+  REG_RBP = 5,
+  REG_RSI = 6,
+  REG_RDI = 7,
+  REG_R8 = 8,
+  REG_R9 = 9,
+  REG_R10 = 10,
+  REG_R11 = 11,
+  REG_R12 = 12,
+  REG_R13 = 13,
+  REG_R14 = 14,
+  REG_R15 = 15,
+
+  REG_COUNT,
+};
+typedef NUM Register;
+
+enum OperatorEnum {
+  OP_NONE,
+  OP_MOV,
+  OP_LEA,
+  OP_TEST,
+  OP_CMP,
+  OP_ADD,
+  OP_SUB,
+  OP_BAND,
+  OP_IMUL, // InstrDst *= InstrSrc, InstrDst is a register
+  OP_BOR,
+  OP_JMP,
+  OP_JNZ,
+  OP_JZ,
+  OP_JL,
+  OP_JLE,
+  OP_JG,
+  OP_JGE,
+
+  // SETcc of InstrDst
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_EQ,
+  OP_NE,
+
+  OP_MOV8,
+  OP_MOVZX8, // zero extends the byte at InstrSrc
+  OP_XOR,
+  OP_SHL,       // InstrDst shifted by InstrSrc, a constant or rcx
+  OP_SAR,
+  OP_SHR,
+  OP_IMUL_WIDE, // rdx:rax = rax * InstrSrc
+  OP_CQO,       // rdx:rax = rax, sign extended
+  OP_IDIV,      // rax = rdx:rax / InstrSrc, rdx = the remainder
+  OP_PUSH,
+  OP_POP,
+  OP_CALL,      // InstrSrc names the function, LOC_EXTERN if it goes through the PLT
+  OP_LABEL,
+  OP_RET,       // the whole epilogue of the function, InstrSrc is rax if it returns a value
+  OP_TAIL_CALL, // the epilogue, then a jump to InstrSrc like OP_CALL
+  OP_COMMENT,   // InstrNode is printed as a comment
+};
+typedef NUM Operator;
+
+#define IS_JUMP(op) ((op) >= OP_JMP && (op) <= OP_JGE)
+
+enum LocationSpace {
+  LOC_NONE = 0,
+  LOC_REGISTER = 1,
+  LOC_RBP_RELATIVE = 2,
+  LOC_CONSTANT = 3,
+  LOC_STRING = 4,
+  LOC_STATIC = 5,
+  LOC_EXTERN = 6,
+  LOC_VREG = 7,     // virtual register, replaced by AllocateRegisters
+  LOC_INDIRECT = 8, // memory pointed to by register LocationOffset
+  LOC_SYMBOL = 9,   // address of LocationName
+  LOC_RSP_RELATIVE = 10, // frame slot in a function without a frame pointer
+  LOC_SCALED = 11,       // register LocationOffset + itself * LocationScale, the source of an LEA
+};
+typedef NUM LocationSpace;
+
+typedef struct Location {
+  LocationSpace LocationSpace;
+  NUM LocationOffset;
+  const char* LocationName; // LOC_STATIC, LOC_EXTERN, LOC_SYMBOL
+  NUM LocationScale;        // LOC_SCALED: 2, 4 or 8
+} Location;
+
+typedef struct Instr {
+  Operator InstrOp;
+  Location InstrDst;
+  Location InstrSrc;
+  NUM InstrLabel;
+  Node* InstrNode;
+} Instr;
+
+typedef struct InstrList {
+  Instr* Instrs;
+  NUM InstrsCount;
+  NUM InstrsCapacity;
+} InstrList;
+
+// Which of an instruction's operands it reads and writes (RegAlloc.c)
+void GetOperandRoles(Instr* instr, BOOL* dst_read, BOOL* dst_written, BOOL* src_read);
+
+NUM AllocateRegisters(InstrList* list, NUM vreg_count, BOOL* vreg_is_variable, NUM stack_offset,
+                      NUM* saved_registers);
+
+// Simplifies the legalized instructions of a function (Peephole.c)
+void OptimizePeephole(InstrList* list);
+
+// Encodes the legalized instructions of a function into the object file (Encode.c)
+void EncodeFunction(const char* name, InstrList* list, ObjFunction* out);
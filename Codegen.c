@@ -1,56 +1,59 @@
+#include <pthread.h>
+#include <unistd.h>
+
 #include "Node.h"
 #include "ProgramData.h"
+#include "Arena.h"
+#include "Asm.h"
+#include "IR.h"
+#include "Object.h"
 
 const NUM NUM_SIZE = 8u;
-static NUM CurrentStackOffset;
-static NUM NextLabel = 0;
-static NUM CurrentBreakLabel = 0;
-static NUM CurrentContinueLabel = 0;
-
-static NUM STACK_FRAME = 2000;
-
-enum RegisterEnum {
-  REG_RAX = 0,
-  REG_RCX = 1,
-  REG_RDX = 2,
-  REG_RBX = 3,
-  REG_RSP = 4,
-  REG_RBP = 5,
-  REG_RSI = 6,
-  REG_RDI = 7,
-  REG_R8 = 8,
-  REG_R9 = 9,
-  REG_R10 = 10,
-  REG_R11 = 11,
-  REG_R12 = 12,
-  REG_R13 = 13,
-  REG_R14 = 14,
-};
-typedef NUM Register;
-
-enum OperatorEnum {
-  OP_NONE,
-  OP_MOV,
-  OP_LEA,
-  OP_TEST,
-  OP_CMP,
-  OP_ADD,
-  OP_SUB,
-  OP_BAND,
-  OP_MUL,
-  OP_BOR,
-  OP_JMP,
-  OP_JNZ,
-  OP_JZ,
-
-  OP_LT,
-  OP_LE,
-  OP_GT,
-  OP_GE,
-  OP_EQ,
-  OP_NE,
-};
-typedef NUM Operator;
+
+// The state of the function being generated is per thread, functions are generated
+// in parallel with -j
+static __thread NUM CurrentStackOffset;
+
+// Bytes between rbp and rsp: address-taken variables, spill slots and saved registers,
+// rounded up to keep rsp 16 byte aligned at calls
+static __thread NUM FrameSize;
+
+// The function being generated is collected here over virtual registers,
+// and printed or encoded once AllocateRegisters has assigned them.
+// IR temps are vregs 0 to IrFnTempCount - 1, codegen adds its own after them.
+static __thread InstrList FnInstrs;
+static __thread InstrList FinalInstrs; // FnInstrs after LegalizeFunction
+static __thread NUM NextVReg;
+static __thread BOOL* VRegIsVariable;
+static __thread NUM VRegCapacity;
+
+// Callee-saved registers the function uses, and where the prologue saves them
+static __thread NUM SavedRegisters;
+static __thread NUM SavedRegisterOffsets[REG_COUNT];
+
+// Functions only set up rbp when they push or with -frame-pointers. Without it rsp is
+// moved down by StackAdjust, and slots are addressed from rsp. Leaf functions whose
+// slots fit in the red zone below rsp don't move it at all.
+static const NUM RED_ZONE_SIZE = 128;
+static BOOL KeepFramePointers;
+static __thread BOOL FramePointer;
+static __thread NUM StackAdjust;
+
+// Where GlobalCodegen writes the object file, NULL when printing NASM
+static const char* ObjectPath;
+static NUM Jobs;
+static BOOL Comments; // print the source expressions in the NASM
+static BOOL Inline;
+static BOOL Peephole;
+
+// NASM is collected in Output and written to stdout in large blocks.
+// Out is where the function being generated goes, Output or its own buffer with -j.
+static const NUM OUTPUT_FLUSH_SIZE = 1 << 16;
+static Buffer Output;
+static __thread Buffer* Out;
+
+// The code of the function being generated when encoding
+static __thread ObjFunction* Encoded;
 
 
 /* clang-format off */
@@ -58,36 +61,30 @@ const char* RegisterNames[] = {
   "rax", "rcx", "rdx", "rbx",
   "rsp", "rbp", "rsi", "rdi",
   "r8", "r9", "r10", "r11",
-  "r12", "r13", "r14",
+  "r12", "r13", "r14", "r15",
 };
 
 const char* RegisterNames8[] = {
   "al", "cl", "dl", "bl",
   "spl", "bpl", "sil", "dil",
-  "r8l", "r9l", "r10l", "r11l",
-  "r12l", "r13l", "r14l",
+  "r8b", "r9b", "r10b", "r11b",
+  "r12b", "r13b", "r14b", "r15b",
 };
-/* clang-format on */
 
-enum LocationSpace {
-  LOC_NONE = 0,
-  LOC_REGISTER = 1,
-  LOC_RBP_RELATIVE = 2,
-  LOC_CONSTANT = 3,
-  LOC_STRING = 4,
-  LOC_STATIC = 5,
-  LOC_EXTERN = 6,
+static Operator IrOperators[IR_COUNT] = {
+  [IR_ADD] = OP_ADD, [IR_SUB] = OP_SUB, [IR_AND] = OP_BAND, [IR_OR] = OP_BOR,
+  [IR_LT] = OP_LT, [IR_LE] = OP_LE, [IR_GT] = OP_GT, [IR_GE] = OP_GE, [IR_EQ] = OP_EQ, [IR_NE] = OP_NE,
+  [IR_SHL] = OP_SHL, [IR_SAR] = OP_SAR, [IR_SHR] = OP_SHR,
+  [IR_JLT] = OP_JL, [IR_JLE] = OP_JLE, [IR_JGT] = OP_JG, [IR_JGE] = OP_JGE, [IR_JEQ] = OP_JZ, [IR_JNE] = OP_JNZ,
 };
-typedef NUM LocationSpace;
-
-typedef struct Location {
-  LocationSpace LocationSpace;
-  NUM LocationOffset;
-} Location;
+/* clang-format on */
 
 static Location ReturnLocation = { LOC_REGISTER, REG_RAX };
 static Location ZeroLocation = { LOC_CONSTANT, 0 };
 static Location TempRegister = { LOC_REGISTER, REG_R11 };
+static Location TempAddress = { LOC_INDIRECT, REG_R11 };
+static Location HighRegister = { LOC_REGISTER, REG_RDX }; // the high half of IMUL_WIDE, the remainder of IDIV
+static Location CountRegister = { LOC_REGISTER, REG_RCX }; // variable shift counts
 
 static Location ArgumentLocationsReg[] = {
   { LOC_REGISTER, REG_RDI },
@@ -99,55 +96,112 @@ static Location ArgumentLocationsReg[] = {
 };
 
 static void NewLine();
-static void CodegenBlock(Fn* fn, Block* block);
 static void PrintLocation(Location* loc);
 static void PrintLocationByte(Location* loc);
-static NUM GetStackFrameSize(Fn* fn);
-static void EmitPush(Location* loc);
-static void EmitPop(Location* loc);
 static void AcquireTemp(Location* out);
 static void Emit(Operator op, Location* dst, Location* src);
 
+static void Write(const char* str) {
+  BufferWrite(Out, str, strlen(str));
+}
+
+static void WriteNum(NUM value) {
+  char digits[24];
+  NUM start          = sizeof(digits);
+  uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+
+  do {
+    digits[--start] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+
+  if (value < 0) digits[--start] = '-';
+  BufferWrite(Out, digits + start, sizeof(digits) - start);
+}
+
+static void FlushOutput() {
+  NUM written = 0;
+  while (written < Output.BufferCount) {
+    ssize_t result = write(STDOUT_FILENO, Output.BufferData + written, Output.BufferCount - written);
+    if (result < 0) {
+      fprintf(stderr, "Failed to write the output\n");
+      exit(1);
+    }
+    written += result;
+  }
+  Output.BufferCount = 0;
+}
+
+// size +offset[rbp], or [rsp] without a frame pointer
+static void PrintSlot(const char* size, Location* loc) {
+  Write(size);
+  if (loc->LocationOffset > 0) {
+    Write(" +");
+    WriteNum(loc->LocationOffset);
+  } else if (loc->LocationOffset < 0) {
+    Write(" -");
+    WriteNum(-loc->LocationOffset);
+  } else {
+    Write(" ");
+  }
+  Write(loc->LocationSpace == LOC_RBP_RELATIVE ? "[rbp]" : "[rsp]");
+}
+
 static void NewLine() {
-  printf("\n    ");
+  Write("\n    ");
 }
 
 static void PrintLocation(Location* loc) {
   switch (loc->LocationSpace) {
     case LOC_CONSTANT: {
-      printf("%ld", loc->LocationOffset);
+      WriteNum(loc->LocationOffset);
       return;
     }
     case LOC_REGISTER: {
-      printf("%s", RegisterNames[loc->LocationOffset]);
+      Write(RegisterNames[loc->LocationOffset]);
       return;
     }
-    case LOC_RBP_RELATIVE: {
-      if (loc->LocationOffset > 0) {
-	printf("QWORD +%ld[rbp]", loc->LocationOffset);
-      } else if (loc->LocationOffset < 0) {
-	printf("QWORD -%ld[rbp]", -loc->LocationOffset);
-      } else {
-	printf("QWORD [rbp]");
-      }
+    case LOC_RBP_RELATIVE:
+    case LOC_RSP_RELATIVE: {
+      PrintSlot("QWORD", loc);
       return;
     }
     case LOC_STRING: {
-      printf("_string%ld", loc->LocationOffset);
+      Write("_string");
+      WriteNum(loc->LocationOffset);
       return;
     }
-    case LOC_STATIC: {
-      Var* var = Nth(StaticVariables, loc->LocationOffset);
-      printf("QWORD [%s]", var->VarName);
+    case LOC_STATIC:
+    case LOC_EXTERN: {
+      Write("QWORD [");
+      Write(loc->LocationName);
+      Write("]");
       return;
     }
-    case LOC_EXTERN: {
-      const char* var = Nth(Externs, loc->LocationOffset);
-      printf("QWORD [%s]", var);
+    case LOC_INDIRECT: {
+      Write("QWORD [");
+      Write(RegisterNames[loc->LocationOffset]);
+      Write("]");
+      return;
+    }
+    case LOC_SYMBOL: {
+      Write(loc->LocationName);
+      return;
+    }
+    case LOC_SCALED: {
+      Write("[");
+      Write(RegisterNames[loc->LocationOffset]);
+      Write("+");
+      Write(RegisterNames[loc->LocationOffset]);
+      Write("*");
+      WriteNum(loc->LocationScale);
+      Write("]");
       return;
     }
     default: {
-      printf("<<<<<%ld>>>>>", loc->LocationSpace);
+      Write("<<<<<");
+      WriteNum(loc->LocationSpace);
+      Write(">>>>>");
       return;
     }
   }
@@ -156,694 +210,945 @@ static void PrintLocation(Location* loc) {
 static void PrintLocationByte(Location* loc) {
   switch (loc->LocationSpace) {
     case LOC_REGISTER: {
-      printf("%s", RegisterNames8[loc->LocationOffset]);
+      Write(RegisterNames8[loc->LocationOffset]);
       return;
     }
-    case LOC_RBP_RELATIVE: {
-      if (loc->LocationOffset > 0) {
-	printf("BYTE +%ld[rbp]", loc->LocationOffset);
-      } else if (loc->LocationOffset < 0) {
-	printf("BYTE -%ld[rbp]", -loc->LocationOffset);
-      } else {
-	printf("BYTE [rbp]");
-      }
+    case LOC_RBP_RELATIVE:
+    case LOC_RSP_RELATIVE: {
+      PrintSlot("BYTE", loc);
+      return;
+    }
+    case LOC_STATIC:
+    case LOC_EXTERN: {
+      Write("BYTE [");
+      Write(loc->LocationName);
+      Write("]");
+      return;
+    }
+    case LOC_INDIRECT: {
+      Write("BYTE [");
+      Write(RegisterNames[loc->LocationOffset]);
+      Write("]");
       return;
     }
   }
 }
 
-static NUM GetStackFrameSize(Fn* fn) {
-  NUM size = Length(fn->FnParamNames) * NUM_SIZE;
-
-  Cons* statement_list = fn->FnBlock->BlockStatements;
-  while (statement_list) {
-    Node* statement = statement_list->Value;
-    statement_list = statement_list->Tail;
-
-    if (statement->NodeType == NODE_VAR)
-      size += NUM_SIZE;
+static NUM NewVReg(BOOL is_variable) {
+  if (NextVReg == VRegCapacity) {
+    VRegCapacity   = VRegCapacity ? VRegCapacity * 2 : 256;
+    VRegIsVariable = realloc(VRegIsVariable, VRegCapacity * sizeof(BOOL));
   }
+  VRegIsVariable[NextVReg] = is_variable;
+  return NextVReg++;
+}
 
-  return size;
+static void AcquireTemp(Location* out) {
+  out->LocationSpace  = LOC_VREG;
+  out->LocationOffset = NewVReg(FALSE);
 }
 
-static void AddressOfRBPRelative(Location* rbp_rel, Location* out) {
-  if (rbp_rel->LocationSpace != LOC_RBP_RELATIVE) {
-    fprintf(stderr, "Invalid AddressOfRBPRelative\n");
-    exit(1);
-  }
-  BOOL allocated_temp = out->LocationSpace == LOC_NONE;
-  if (allocated_temp) AcquireTemp(out);
+static BOOL IsMemoryLocation(NUM loc) {
+  return loc == LOC_RBP_RELATIVE || loc == LOC_RSP_RELATIVE || loc == LOC_STATIC || loc == LOC_EXTERN
+      || loc == LOC_INDIRECT;
+}
 
-  Emit(OP_LEA, &TempRegister, rbp_rel);
-  Emit(OP_MOV, out, &TempRegister);
+static BOOL IsAddressLocation(NUM loc) {
+  return loc == LOC_STRING || loc == LOC_SYMBOL;
 }
 
-static NUM GetLocalsCount(Fn* fn) {
-  NUM count = 0;
-  Cons* statement_list = fn->FnBlock->BlockStatements;
-  while (statement_list) {
-    Node* statement = statement_list->Value;
-    if (statement->NodeType == NODE_VAR) {
-      count++;
-    }
-    statement_list = statement_list->Tail;
+static BOOL IsImmediate32(NUM value) {
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static Instr* AppendInstr(InstrList* list, Operator op) {
+  if (list->InstrsCount == list->InstrsCapacity) {
+    list->InstrsCapacity = list->InstrsCapacity ? list->InstrsCapacity * 2 : 1024;
+    list->Instrs         = realloc(list->Instrs, list->InstrsCapacity * sizeof(Instr));
   }
 
-  return count;
+  Instr* instr = &list->Instrs[list->InstrsCount++];
+  memset(instr, 0, sizeof(Instr));
+  instr->InstrOp = op;
+  return instr;
 }
 
-static void GetVarLocation(Fn* fn, const char* var_name, Location* out, BOOL is_lvalue) {
-  // Check if it's a parameter
-  NUM argument_index = 0;
+static Instr* AddInstr(Operator op) {
+  return AppendInstr(&FnInstrs, op);
+}
 
-  Cons* argument_list = fn->FnParamNames;
-  while (argument_list) {
-    char* arg_name = argument_list->Value;
-    if (strcmp(arg_name, var_name) == 0) {
-      Location loc;
-      loc.LocationSpace = LOC_RBP_RELATIVE;
-      loc.LocationOffset = -(argument_index + 1) * NUM_SIZE;
+static void Emit(Operator op, Location* dst, Location* src) {
+  Instr* instr    = AddInstr(op);
+  instr->InstrDst = *dst;
+  instr->InstrSrc = *src;
+}
 
-      if (is_lvalue) {
-	AddressOfRBPRelative(&loc, out);
-      } else {
-	out->LocationSpace  = loc.LocationSpace;
-	out->LocationOffset = loc.LocationOffset;
-      }
-      return;
-    }
-    argument_index++;
-    argument_list = argument_list->Tail;
-  }
+static void EmitSet(Operator op, Location* dst, Location* lhs, Location* rhs) {
+  Emit(OP_CMP, lhs, rhs);
 
-  // Check if it's a local variable
-  NUM local_index = 0;
-  Cons* statement_list = fn->FnBlock->BlockStatements;
-  while (statement_list) {
-    Node* statement = statement_list->Value;
-    statement_list = statement_list->Tail;
+  Emit(OP_MOV, dst, &ZeroLocation);
 
-    if (statement->NodeType == NODE_VAR) {
-      const char* other_name = ((Var*)statement)->VarName;
-      if (strcmp(other_name, var_name) == 0) {
-	Location loc;
+  AddInstr(op)->InstrDst = *dst;
+}
 
-	loc.LocationSpace  = LOC_RBP_RELATIVE;
-	loc.LocationOffset = -( GetLocalsCount(fn) + Length(fn->FnParamNames) - local_index) * NUM_SIZE;
+static void EmitShiftBy(Operator op, Location* dst, NUM count) {
+  Location amount = { LOC_CONSTANT, count & 63 };
+  if (amount.LocationOffset) Emit(op, dst, &amount);
+}
 
-	if (is_lvalue) {
-	  AddressOfRBPRelative(&loc, out);
-	} else {
-	  out->LocationSpace = loc.LocationSpace;
-	  out->LocationOffset = loc.LocationOffset;
-	}
-        return;
-      }
-      local_index ++;
-    }
+// Multiplications by a power of 2, optionally times 3, 5 or 9, are done with an LEA and a shift
+static void EmitMul(Location* dst, Location* lhs, Location* rhs) {
+  if (lhs->LocationSpace == LOC_CONSTANT) {
+    Location* constant = lhs;
+    lhs                = rhs;
+    rhs                = constant;
   }
 
-  // Check if it's a static
-  Cons* statics = StaticVariables;
-  NUM static_index = 0;
-  while (statics) {
-    Var* var = statics->Value;
-    if (strcmp(var->VarName, var_name) == 0) {
-      out->LocationSpace = LOC_STATIC;
-      out->LocationOffset = static_index;
+  if (rhs->LocationSpace == LOC_CONSTANT && rhs->LocationOffset != 0) {
+    uint64_t factor = rhs->LocationOffset;
+    NUM shift       = __builtin_ctzll(factor);
+    factor >>= shift;
+
+    if (factor == 1) {
+      Emit(OP_MOV, dst, lhs);
+      EmitShiftBy(OP_SHL, dst, shift);
       return;
     }
-    statics = statics->Tail;
-    static_index++;
-  }
 
-  // Check if it's a extern
-  Cons* extern_var = Externs;
-  NUM extern_index = 0;
-  while (extern_var) {
-    const char* var = extern_var->Value;
-    if (strcmp(var, var_name) == 0) {
-      out->LocationSpace = LOC_EXTERN;
-      out->LocationOffset = extern_index;
+    if (factor == 3 || factor == 5 || factor == 9) {
+      Location scaled = { LOC_SCALED, REG_R11, NULL, factor - 1 };
+      Emit(OP_MOV, &TempRegister, lhs);
+      Emit(OP_LEA, &TempRegister, &scaled);
+      EmitShiftBy(OP_SHL, &TempRegister, shift);
+      Emit(OP_MOV, dst, &TempRegister);
       return;
     }
-    extern_var = extern_var->Tail;
-    extern_index++;
   }
 
-  // error
-  fprintf(stderr, "Invalid variable %s\n", var_name);
-  exit(1);
-}
-
-static void AcquireTemp(Location* out) {
-  CurrentStackOffset -= NUM_SIZE;
-  out->LocationSpace = LOC_RBP_RELATIVE;
-  out->LocationOffset = CurrentStackOffset;
-
-  if (CurrentStackOffset < -(STACK_FRAME - 10)) {
-    fprintf(stderr, "Function blew up the stack frame\n");
-    exit(1);
-  }
+  Emit(OP_MOV, dst, lhs);
+  Emit(OP_IMUL, dst, rhs);
 }
 
-static void CodegenExpression(Fn* fn, Node* expression, Location* expr_location, BOOL is_lvalue);
+// The magic number and shift that divide by d with a multiply, for |d| >= 2.
+// From Hacker's Delight, 10-4: the quotient is the high half of magic * n, plus or
+// minus n when magic and d have different signs, shifted right, plus 1 if negative.
+static void GetDivisionMagic(NUM d, NUM* magic, NUM* shift) {
+  const uint64_t two63 = 1ull << 63;
+  uint64_t ad          = d < 0 ? -(uint64_t)d : (uint64_t)d;
+  uint64_t t           = two63 + ((uint64_t)d >> 63);
+  uint64_t anc         = t - 1 - t % ad;
+  uint64_t q1          = two63 / anc;
+  uint64_t r1          = two63 - q1 * anc;
+  uint64_t q2          = two63 / ad;
+  uint64_t r2          = two63 - q2 * ad;
+  NUM p                = 63;
+  uint64_t delta;
+
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
 
-static BOOL IsMemoryLocation(NUM loc) {
-  return loc == LOC_RBP_RELATIVE || loc == LOC_STATIC || loc == LOC_STRING || loc == LOC_EXTERN;
+  *magic = d < 0 ? -(NUM)(q2 + 1) : (NUM)(q2 + 1);
+  *shift = p - 64;
 }
 
-static void Emit(Operator op, Location* dst, Location* src) {
-  Location* src1 = src;
-  Location* dst1 = dst;
-
-  if (IsMemoryLocation(src->LocationSpace) && IsMemoryLocation(dst->LocationSpace)) {
-    NewLine();
-    printf("MOV ");
-    src1 = &TempRegister;
-    PrintLocation(src1);
-    printf(", ");
-    PrintLocation(src);
+// The quotient of lhs and the constant d, |d| >= 2, left in rdx
+static void EmitDivideByConstant(Location* lhs, NUM d) {
+  uint64_t magnitude = d < 0 ? -(uint64_t)d : (uint64_t)d;
+
+  if ((magnitude & (magnitude - 1)) == 0) {
+    // Shifting right rounds down, negative numbers need 2^k - 1 added first to round towards 0
+    NUM k = __builtin_ctzll(magnitude);
+    Emit(OP_MOV, &HighRegister, lhs);
+    EmitShiftBy(OP_SAR, &HighRegister, 63);
+    EmitShiftBy(OP_SHR, &HighRegister, 64 - k);
+    Emit(OP_ADD, &HighRegister, lhs);
+    EmitShiftBy(OP_SAR, &HighRegister, k);
   }
-
-  else if (dst->LocationSpace == LOC_CONSTANT) {
-    NewLine();
-    printf("MOV ");
-    dst1 = &TempRegister;
-    PrintLocation(dst1);
-    printf(", ");
-    PrintLocation(dst);
+  else {
+    NUM magic, shift;
+    GetDivisionMagic(d, &magic, &shift);
+
+    Location magic_location = { LOC_CONSTANT, magic };
+    Emit(OP_MOV, &ReturnLocation, &magic_location);
+    AddInstr(OP_IMUL_WIDE)->InstrSrc = *lhs;
+    if (d > 0 && magic < 0) Emit(OP_ADD, &HighRegister, lhs);
+    if (d < 0 && magic > 0) Emit(OP_SUB, &HighRegister, lhs);
+    EmitShiftBy(OP_SAR, &HighRegister, shift);
+
+    Emit(OP_MOV, &TempRegister, &HighRegister);
+    EmitShiftBy(OP_SHR, &TempRegister, 63);
+    Emit(OP_ADD, &HighRegister, &TempRegister);
+    return;
   }
 
-  NewLine();
-  switch (op) {
-  case OP_MOV: printf("MOV "); break;
-  case OP_LEA: printf("LEA "); break;
-  case OP_ADD: printf("ADD "); break;
-  case OP_SUB: printf("SUB "); break;
-  case OP_BAND: printf("AND "); break;
-  case OP_BOR: printf("OR "); break;
-  case OP_TEST: printf("TEST "); break;
-  case OP_CMP: printf("CMP "); break;
+  if (d < 0) {
+    Emit(OP_MOV, &TempRegister, &ZeroLocation);
+    Emit(OP_SUB, &TempRegister, &HighRegister);
+    Emit(OP_MOV, &HighRegister, &TempRegister);
   }
-  PrintLocation(dst1);
-  printf(", ");
-  PrintLocation(src1);
 }
 
-static void EmitSet(Operator op, Location* dst, Location* lhs, Location* rhs) {
-  Emit(OP_CMP, lhs, rhs);
-
-  Emit(OP_MOV, dst, &ZeroLocation);
-
-  NewLine();
-  switch (op) {
-    case OP_LT: printf("SETL "); break;
-    case OP_LE: printf("SETLE "); break;
-    case OP_GT: printf("SETG "); break;
-    case OP_GE: printf("SETGE "); break;
-    case OP_EQ: printf("SETE "); break;
-    case OP_NE: printf("SETNE "); break;
+// dst = lhs / rhs or lhs % rhs. Division by constants is done with shifts and multiplies,
+// by anything else with IDIV.
+static void EmitDivide(Location* dst, Location* lhs, Location* rhs, BOOL remainder) {
+  NUM d = rhs->LocationOffset;
+  if (rhs->LocationSpace == LOC_CONSTANT && (d == 1 || d == -1)) {
+    if (remainder) {
+      Emit(OP_MOV, dst, &ZeroLocation);
+    } else if (d == 1) {
+      Emit(OP_MOV, dst, lhs);
+    } else {
+      Emit(OP_MOV, &TempRegister, &ZeroLocation);
+      Emit(OP_SUB, &TempRegister, lhs);
+      Emit(OP_MOV, dst, &TempRegister);
+    }
+    return;
   }
 
-  PrintLocationByte(dst);
-}
-
-static void EmitPush(Location* loc) {
-  NewLine();
-  printf("PUSH ");
-  PrintLocation(loc);
-}
+  if (rhs->LocationSpace == LOC_CONSTANT && d != 0) {
+    EmitDivideByConstant(lhs, d);
+    if (remainder) {
+      // lhs - quotient * d
+      EmitMul(&HighRegister, &HighRegister, rhs);
+      Emit(OP_MOV, &TempRegister, lhs);
+      Emit(OP_SUB, &TempRegister, &HighRegister);
+      Emit(OP_MOV, dst, &TempRegister);
+    } else {
+      Emit(OP_MOV, dst, &HighRegister);
+    }
+    return;
+  }
 
-static void EmitPop(Location* loc) {
-  NewLine();
-  printf("POP ");
-  PrintLocation(loc);
+  Emit(OP_MOV, &ReturnLocation, lhs);
+  AddInstr(OP_CQO);
+  AddInstr(OP_IDIV)->InstrSrc = *rhs;
+  Emit(OP_MOV, dst, remainder ? &HighRegister : &ReturnLocation);
 }
 
-static void EmitMul(Location* dst, Location* lhs, Location* rhs) {
-  Location RDX = { LOC_REGISTER, REG_RAX };
-  Location RAX = { LOC_REGISTER, REG_RAX };
-
-  EmitPush(&RDX);
-  EmitPush(&RAX);
-  Emit(OP_MOV, &RAX, lhs);
-
-
-  Location* rhs2 = rhs;
-  if (rhs2->LocationSpace == LOC_CONSTANT) {
-    Emit(OP_MOV, &TempRegister, rhs2);
-    rhs2 = &TempRegister;
+// Variable counts have to be in cl
+static void EmitShift(Operator op, Location* dst, Location* lhs, Location* rhs) {
+  if (rhs->LocationSpace == LOC_CONSTANT) {
+    Emit(OP_MOV, dst, lhs);
+    EmitShiftBy(op, dst, rhs->LocationOffset);
+    return;
   }
 
-  NewLine();
-  printf("MUL ");
-  PrintLocation(rhs2);
-
-  Emit(OP_MOV, dst, &RAX);
-
-  EmitPop(&RAX);
-  EmitPop(&RDX);
-}
-
-static NUM GetLabel() {
-  return NextLabel++;
+  Emit(OP_MOV, &TempRegister, lhs);
+  Emit(OP_MOV, &CountRegister, rhs);
+  Emit(op, &TempRegister, &CountRegister);
+  Emit(OP_MOV, dst, &TempRegister);
 }
 
 static void PlaceLabel(NUM label) {
-  printf("\n_label%ld:", label);
+  AddInstr(OP_LABEL)->InstrLabel = label;
 }
 
 static void EmitJump(Operator jumpType, NUM label) {
-  NewLine();
-  switch (jumpType) {
-  case OP_JMP: printf("JMP "); break;
-  case OP_JNZ: printf("JNZ "); break;
-  case OP_JZ: printf("JZ "); break;
-  }
-  printf("_label%ld", label);
+  AddInstr(jumpType)->InstrLabel = label;
 }
 
-static void EmitRet(Fn* fn) {
-  NewLine();
-  printf("ADD rsp, %ld\n", STACK_FRAME);
-  NewLine();
-  printf("POP rbp");
-  NewLine();
-  printf("RET");
+static void SlotLocation(NUM slot, Location* out) {
+  out->LocationSpace  = LOC_RBP_RELATIVE;
+  out->LocationOffset = -(slot + 1) * NUM_SIZE;
 }
 
-static void CodegenOperator(Fn* fn, Call* call, Operator op, Location* destination) {
-  BOOL allocated_temp = destination->LocationSpace == LOC_NONE;
-  if (allocated_temp) AcquireTemp(destination);
+// Where an IR operand's value can be read from
+static void OperandLocation(Operand* operand, Location* out) {
+  switch (operand->OperandKind) {
+    case IRO_TEMP: *out = (Location){ LOC_VREG, operand->OperandValue }; return;
+    case IRO_CONST: *out = (Location){ LOC_CONSTANT, operand->OperandValue }; return;
+    case IRO_STRING: *out = (Location){ LOC_STRING, operand->OperandValue }; return;
+    case IRO_GLOBAL: *out = (Location){ LOC_SYMBOL, 0, operand->OperandName }; return;
+    case IRO_SLOT: {
+      Location slot;
+      SlotLocation(operand->OperandValue, &slot);
+      AcquireTemp(out);
+      Emit(OP_LEA, &TempRegister, &slot);
+      Emit(OP_MOV, out, &TempRegister);
+      return;
+    }
+  }
 
-  Cons* args = call->CallArguments;
+  fprintf(stderr, "Invalid IR operand\n");
+  exit(1);
+}
 
-  CodegenExpression(fn, args->Value, destination, FALSE);
-  args = args->Tail;
+// The memory an IR address operand points to, using r11 for computed addresses
+static void AddressedLocation(Operand* address, Location* out) {
+  switch (address->OperandKind) {
+    case IRO_SLOT: SlotLocation(address->OperandValue, out); return;
+    case IRO_GLOBAL: *out = (Location){ LOC_STATIC, 0, address->OperandName }; return;
+  }
 
-  while (args) {
-    Node* arg_expression = args->Value;
-    Location arg_location = { LOC_NONE };
-    CodegenExpression(fn, arg_expression, &arg_location, FALSE);
-    Emit(op, destination, &arg_location);
+  Location loc;
+  OperandLocation(address, &loc);
+  Emit(OP_MOV, &TempRegister, &loc);
+  *out = TempAddress;
+}
+
+// A call whose result is returned right away. It can jump to the function once the
+// frame is gone, as long as no argument can point into the frame.
+static BOOL IsTailCall(IrFn* fn, NUM index) {
+  Ir* call = &fn->IrFnCode[index];
+  if (call->IrOp != IR_CALL || fn->IrFnSlotCount > 0) return FALSE;
 
-    args = args->Tail;
+  for (NUM i = index + 1; i < fn->IrFnCodeCount; i++) {
+    Ir* ir = &fn->IrFnCode[i];
+    if (ir->IrOp == IR_COMMENT) continue;
+    return ir->IrOp == IR_RET && ir->IrA.OperandKind == IRO_TEMP && ir->IrA.OperandValue == call->IrDst;
   }
+  return FALSE;
 }
 
+static void CodegenCall(Ir* ir, Location* destination, BOOL is_tail) {
+  // A zero length array is undefined
+  Location loc[ir->IrArgCount ? ir->IrArgCount : 1];
 
-static void CodegenComparisonOperator(Fn* fn, Call* call, Operator op, Location* destination) {
-  BOOL allocated_temp = destination->LocationSpace == LOC_NONE;
-  if (allocated_temp) AcquireTemp(destination);
+  for (NUM i = 0; i < ir->IrArgCount; i++) {
+    OperandLocation(&ir->IrArgs[i], &loc[i]);
+  }
 
-  Location lhs_location = { LOC_NONE };
-  Location rhs_location = { LOC_NONE };
+  for (NUM i = 0; i < ir->IrArgCount; i++) {
+    Emit(OP_MOV, &ArgumentLocationsReg[i], &loc[i]);
+  }
 
-  Cons* args = call->CallArguments;
-  CodegenExpression(fn, args->Value, &lhs_location, FALSE);
+  Emit(OP_XOR, &ReturnLocation, &ReturnLocation);
 
-  args = args->Tail;
-  CodegenExpression(fn, args->Value, &rhs_location, FALSE);
+  Instr* instr    = AddInstr(is_tail ? OP_TAIL_CALL : OP_CALL);
+  instr->InstrSrc = (Location){ IsExternName(ir->IrName) ? LOC_EXTERN : LOC_SYMBOL, 0, ir->IrName };
 
-  if (op == OP_MUL) {
-    EmitMul(destination, &lhs_location, &rhs_location);
-  }
-  else {
-    EmitSet(op, destination, &lhs_location, &rhs_location);
-  }
+  if (!is_tail) Emit(OP_MOV, destination, &ReturnLocation);
 }
 
-static void DereferenceR11(Location* destination, BOOL byte) {
-  Emit(OP_MOV, destination, &ZeroLocation);
-
-  if (byte) {
-    NewLine();
-    printf("MOV r11b, [r11]");
-    NewLine();
-    printf("AND r11, 0x00000000000000FF");
-
-    NewLine();
-    printf("MOV ");
-    PrintLocationByte(destination);
-    printf(", r11b");
-  } else {
-    NewLine();
-    printf("MOV r11, [r11]");
+static void CodegenIr(Ir* ir) {
+  Location dst = { LOC_VREG, ir->IrDst };
+  Location a, b;
 
-    NewLine();
-    printf("MOV ");
-    PrintLocation(destination);
-    printf(", r11");
+  switch (ir->IrOp) {
+    case IR_COMMENT: {
+      if (Comments) AddInstr(OP_COMMENT)->InstrNode = ir->IrNode;
+      return;
+    }
+    case IR_LABEL: {
+      PlaceLabel(ir->IrLabel);
+      return;
+    }
+    case IR_JMP: {
+      EmitJump(OP_JMP, ir->IrLabel);
+      return;
+    }
+    case IR_JZ:
+    case IR_JNZ: {
+      OperandLocation(&ir->IrA, &a);
+      Emit(OP_TEST, &a, &a);
+      EmitJump(ir->IrOp == IR_JZ ? OP_JZ : OP_JNZ, ir->IrLabel);
+      return;
+    }
+    case IR_JLT:
+    case IR_JLE:
+    case IR_JGT:
+    case IR_JGE:
+    case IR_JEQ:
+    case IR_JNE: {
+      OperandLocation(&ir->IrA, &a);
+      OperandLocation(&ir->IrB, &b);
+      Emit(OP_CMP, &a, &b);
+      EmitJump(IrOperators[ir->IrOp], ir->IrLabel);
+      return;
+    }
+    case IR_RET: {
+      if (ir->IrA.OperandKind == IRO_NONE) {
+	AddInstr(OP_RET);
+	return;
+      }
+      OperandLocation(&ir->IrA, &a);
+      Emit(OP_MOV, &ReturnLocation, &a);
+      AddInstr(OP_RET)->InstrSrc = ReturnLocation;
+      return;
+    }
+    case IR_COPY: {
+      OperandLocation(&ir->IrA, &a);
+      Emit(OP_MOV, &dst, &a);
+      return;
+    }
+    case IR_ADD:
+    case IR_SUB:
+    case IR_AND:
+    case IR_OR: {
+      OperandLocation(&ir->IrA, &a);
+      OperandLocation(&ir->IrB, &b);
+      Emit(OP_MOV, &dst, &a);
+      Emit(IrOperators[ir->IrOp], &dst, &b);
+      return;
+    }
+    case IR_MUL: {
+      OperandLocation(&ir->IrA, &a);
+      OperandLocation(&ir->IrB, &b);
+      EmitMul(&dst, &a, &b);
+      return;
+    }
+    case IR_DIV:
+    case IR_MOD: {
+      OperandLocation(&ir->IrA, &a);
+      OperandLocation(&ir->IrB, &b);
+      EmitDivide(&dst, &a, &b, ir->IrOp == IR_MOD);
+      return;
+    }
+    case IR_SHL:
+    case IR_SAR:
+    case IR_SHR: {
+      OperandLocation(&ir->IrA, &a);
+      OperandLocation(&ir->IrB, &b);
+      EmitShift(IrOperators[ir->IrOp], &dst, &a, &b);
+      return;
+    }
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+    case IR_EQ:
+    case IR_NE: {
+      OperandLocation(&ir->IrA, &a);
+      OperandLocation(&ir->IrB, &b);
+      EmitSet(IrOperators[ir->IrOp], &dst, &a, &b);
+      return;
+    }
+    case IR_LOAD: {
+      AddressedLocation(&ir->IrA, &a);
+      Emit(OP_MOV, &dst, &a);
+      return;
+    }
+    case IR_LOAD8: {
+      AddressedLocation(&ir->IrA, &a);
+      Emit(OP_MOVZX8, &TempRegister, &a);
+      Emit(OP_MOV, &dst, &TempRegister);
+      return;
+    }
+    case IR_STORE:
+    case IR_STORE8: {
+      // The value goes through rax, memory-to-memory moves and 64 bit immediates can't be stored directly
+      OperandLocation(&ir->IrB, &b);
+      Emit(OP_MOV, &ReturnLocation, &b);
+      AddressedLocation(&ir->IrA, &a);
+      Emit(ir->IrOp == IR_STORE8 ? OP_MOV8 : OP_MOV, &a, &ReturnLocation);
+      return;
+    }
+    case IR_CALL: {
+      CodegenCall(ir, &dst, FALSE);
+      return;
+    }
   }
-}
 
-static void CodegenGet(Fn* fn, Call* call, Location* destination, BOOL byte) {
-  BOOL allocated_temp = destination->LocationSpace == LOC_NONE;
-  if (allocated_temp) AcquireTemp(destination);
+  fprintf(stderr, "IR op %ld not implemented\n", ir->IrOp);
+  exit(1);
+}
 
-  CodegenExpression(fn, call->CallArguments->Value, &TempRegister, FALSE);
-  DereferenceR11(destination, byte);
+static void Append(InstrList* list, Operator op, Location* dst, Location* src) {
+  Instr* instr    = AppendInstr(list, op);
+  instr->InstrDst = *dst;
+  instr->InstrSrc = *src;
 }
 
-static void CodegenAddr(Fn* fn, Call* call, Location* destination, BOOL byte) {
-  CodegenExpression(fn, call->CallArguments->Value, destination, TRUE);
+// Frame slots are allocated rbp-relative, this addresses them from rsp when there's no frame pointer
+static void RebaseSlot(Location* loc) {
+  if (FramePointer || loc->LocationSpace != LOC_RBP_RELATIVE) return;
+  loc->LocationSpace = LOC_RSP_RELATIVE;
+  loc->LocationOffset += StackAdjust;
 }
 
-static BOOL IsPLT(const char* name) {
-  Cons* nodes = Externs;
+// Restores the registers and rsp as they were on entry, without returning
+static void AppendEpilogue(InstrList* list) {
+  for (Register reg = 0; reg < REG_COUNT; reg++) {
+    if (!(SavedRegisters & (1 << reg))) continue;
+    Location saved_register = { LOC_REGISTER, reg };
+    Location save_slot      = { LOC_RBP_RELATIVE, SavedRegisterOffsets[reg] };
+    RebaseSlot(&save_slot);
+    Append(list, OP_MOV, &saved_register, &save_slot);
+  }
 
-  while (nodes) {
-    if (strcmp(name, nodes->Value) == 0) return TRUE;
-    nodes = nodes->Tail;
+  Location rsp    = { LOC_REGISTER, REG_RSP };
+  Location rbp    = { LOC_REGISTER, REG_RBP };
+  Location frame  = { LOC_CONSTANT, FrameSize };
+  Location adjust = { LOC_CONSTANT, StackAdjust };
+  if (FramePointer) {
+    if (FrameSize) Append(list, OP_ADD, &rsp, &frame);
+    AppendInstr(list, OP_POP)->InstrDst = rbp;
+  } else if (StackAdjust) {
+    Append(list, OP_ADD, &rsp, &adjust);
   }
-  return FALSE;
 }
 
-static void CodegenArrow(Fn* fn, Call* call, Location* destination, BOOL is_lvalue) {
-
-  CodegenOperator(fn, call, OP_ADD, destination);
-
-  /* BOOL allocated_temp = destination->LocationSpace == LOC_NONE; */
-  /* if (allocated_temp) AcquireTemp(destination); */
-
-  /* Location lhs_loc = { LOC_NONE }; */
-  /* Location rhs_loc = { LOC_NONE }; */
-  /* Node* lhs = call->CallArguments->Value; */
-  /* Node* rhs = call->CallArguments->Tail->Value; */
-
-  /* CodegenExpression(fn, lhs, &lhs_loc, FALSE); */
-  /* CodegenExpression(fn, rhs, &rhs_loc, FALSE); */
-  /* Emit(OP_ADD, &lhs_loc, &rhs_loc); */
-
-  if (!is_lvalue) {
-    Emit(OP_MOV, &TempRegister, destination);
-    DereferenceR11(destination, FALSE);
+// Turns the allocated instructions into ones that exist on x86, with the prologue and
+// epilogues spelled out. Both the NASM printer and the encoder work from the result.
+static void LegalizeFunction(InstrList* in, InstrList* out) {
+  Location rsp    = { LOC_REGISTER, REG_RSP };
+  Location rbp    = { LOC_REGISTER, REG_RBP };
+  Location frame  = { LOC_CONSTANT, FrameSize };
+  Location adjust = { LOC_CONSTANT, StackAdjust };
+  Location rax    = ReturnLocation;
+
+  out->InstrsCount = 0;
+  if (FramePointer) {
+    AppendInstr(out, OP_PUSH)->InstrSrc = rbp;
+    Append(out, OP_MOV, &rbp, &rsp);
+    if (FrameSize) Append(out, OP_SUB, &rsp, &frame);
+  } else if (StackAdjust) {
+    Append(out, OP_SUB, &rsp, &adjust);
   }
-}
 
-  static void CodegenCall(Fn* fn, Call* call, Location* destination, BOOL is_lvalue) {
-  if (call->CallFunction->NodeType != NODE_REFERENCE) {
-    fprintf(stderr, "Invalid function call\n");
-    exit(1);
+  for (Register reg = 0; reg < REG_COUNT; reg++) {
+    if (!(SavedRegisters & (1 << reg))) continue;
+    Location saved_register = { LOC_REGISTER, reg };
+    Location save_slot      = { LOC_RBP_RELATIVE, SavedRegisterOffsets[reg] };
+    RebaseSlot(&save_slot);
+    Append(out, OP_MOV, &save_slot, &saved_register);
   }
 
-  const char* fn_name = ((Reference*)call->CallFunction)->ReferenceName;
+  for (NUM i = 0; i < in->InstrsCount; i++) {
+    Instr instr = in->Instrs[i];
+    Operator op = instr.InstrOp;
+    RebaseSlot(&instr.InstrDst);
+    RebaseSlot(&instr.InstrSrc);
+
+    // Params often get their argument register, which leaves a MOV to itself
+    if (op == OP_MOV && instr.InstrDst.LocationSpace == LOC_REGISTER
+        && instr.InstrSrc.LocationSpace == LOC_REGISTER
+        && instr.InstrDst.LocationOffset == instr.InstrSrc.LocationOffset)
+      continue;
+
+    if (op == OP_RET || op == OP_TAIL_CALL) {
+      AppendEpilogue(out);
+      *AppendInstr(out, op) = instr;
+      continue;
+    }
 
-  // Builtins:
-  /* clang-format off */
-  if (strcmp(fn_name, "+") == 0) { CodegenOperator(fn, call, OP_ADD, destination); return; }
-  if (strcmp(fn_name, "-") == 0) { CodegenOperator(fn, call, OP_SUB, destination); return; }
-  if (strcmp(fn_name, "&") == 0) { CodegenOperator(fn, call, OP_BAND, destination); return; }
-  if (strcmp(fn_name, "|") == 0) { CodegenOperator(fn, call, OP_BOR, destination); return; }
-  if (strcmp(fn_name, ">")  == 0) { CodegenComparisonOperator(fn, call, OP_GT, destination); return; }
-  if (strcmp(fn_name, "<")  == 0) { CodegenComparisonOperator(fn, call, OP_LT, destination); return; }
-  if (strcmp(fn_name, ">=") == 0) { CodegenComparisonOperator(fn, call, OP_GE, destination); return; }
-  if (strcmp(fn_name, "<=") == 0) { CodegenComparisonOperator(fn, call, OP_LE, destination); return; }
-  if (strcmp(fn_name, "==")  == 0) { CodegenComparisonOperator(fn, call, OP_EQ, destination); return; }
-  if (strcmp(fn_name, "!=") == 0) { CodegenComparisonOperator(fn, call, OP_NE, destination); return; }
-  if (strcmp(fn_name, "*") == 0)  { CodegenComparisonOperator(fn, call, OP_MUL, destination); return; }
-  if (strcmp(fn_name, "->") == 0)  { CodegenArrow(fn, call, destination, is_lvalue); return; }
-  if (strcmp(fn_name, "get") == 0) { CodegenGet(fn, call, destination, FALSE); return; }
-  if (strcmp(fn_name, "get8") == 0) { CodegenGet(fn, call, destination, TRUE); return; }
-  if (strcmp(fn_name, "addr") == 0) { CodegenAddr(fn, call, destination, TRUE); return; }
-  /* clang-format on */
+    // One operand IMUL and IDIV have no immediate form
+    if ((op == OP_IMUL_WIDE || op == OP_IDIV) && instr.InstrSrc.LocationSpace == LOC_CONSTANT) {
+      Append(out, OP_MOV, &TempRegister, &instr.InstrSrc);
+      instr.InstrSrc = TempRegister;
+    }
 
-  BOOL allocated_temp = destination->LocationSpace == LOC_NONE;
-  if (allocated_temp) AcquireTemp(destination);
+    if (op != OP_MOV && op != OP_LEA && op != OP_ADD && op != OP_SUB && op != OP_BAND && op != OP_BOR
+        && op != OP_XOR && op != OP_TEST && op != OP_CMP && op != OP_IMUL) {
+      *AppendInstr(out, op) = instr;
+      continue;
+    }
 
-  NUM argument_index = 0;
-  Cons* arg = call->CallArguments;
+    Location* dst = &instr.InstrDst;
+    Location* src = &instr.InstrSrc;
 
-  Location loc[Length(call->CallArguments)];
+    // x86 has no constant destinations (CMP 5, x), go through r11
+    if (dst->LocationSpace == LOC_CONSTANT) {
+      Append(out, OP_MOV, &TempRegister, dst);
+      *dst = TempRegister;
+    }
 
-  while (arg) {
-    AcquireTemp(&loc[argument_index]);
+    // Sources that have to be in a register first: memory when the destination is memory too,
+    // immediates wider than 32 bits and addresses outside of a MOV to a register
+    BOOL to_register = op == OP_MOV && dst->LocationSpace == LOC_REGISTER;
+    if ((IsMemoryLocation(src->LocationSpace) && IsMemoryLocation(dst->LocationSpace))
+        || (src->LocationSpace == LOC_CONSTANT && !IsImmediate32(src->LocationOffset) && !to_register)
+        || (IsAddressLocation(src->LocationSpace) && !to_register)) {
+      Location* scratch = dst->LocationOffset == REG_R11 && dst->LocationSpace == LOC_REGISTER ? &rax : &TempRegister;
+      Append(out, OP_MOV, scratch, src);
+      *src = *scratch;
+    }
 
-    CodegenExpression(fn, arg->Value, &loc[argument_index], FALSE);
-    arg = arg->Tail;
-    argument_index++;
-  }
+    // IMUL only multiplies into a register
+    if (op == OP_IMUL && dst->LocationSpace != LOC_REGISTER) {
+      Append(out, OP_MOV, &rax, dst);
+      Append(out, OP_IMUL, &rax, src);
+      Append(out, OP_MOV, dst, &rax);
+      continue;
+    }
 
-  for (NUM i = 0; i < argument_index; i++) {
-    Emit(OP_MOV, &ArgumentLocationsReg[i], &loc[i]);
+    *AppendInstr(out, op) = instr;
   }
-
-  NewLine();
-  printf("XOR rax, rax");
-
-  NewLine();
-  printf("CALL %s", fn_name);
-
-  if (IsPLT(fn_name))
-    printf(" WRT ..plt");
-
-  Emit(OP_MOV, &TempRegister, &ReturnLocation);
-  Emit(OP_MOV, destination, &TempRegister);
-
-  return;
 }
 
-static void CodegenNumber(Fn* fn, NUM number, Location* expr_location) {
-  if (expr_location->LocationSpace == LOC_NONE) {
-    expr_location->LocationSpace  = LOC_CONSTANT;
-    expr_location->LocationOffset = number;
-  } else {
-    Location loc = {LOC_CONSTANT, number};
-    Emit(OP_MOV, expr_location, &loc);
-  }
-}
+static void PrintInstr(Instr* instr) {
+  Operator op    = instr->InstrOp;
+  Location* src1 = &instr->InstrSrc;
+  Location* dst1 = &instr->InstrDst;
 
-static void CodegenExpression(Fn* fn, Node* expression, Location* expr_location, BOOL is_lvalue) {
-  printf("\n; ");
-  PrintNode(expression, 0);
-  switch (expression->NodeType) {
-    case NODE_NUMBER: {
-      CodegenNumber(fn, ((Number*)expression)->NumberValue, expr_location);
+  switch (op) {
+    case OP_LABEL: {
+      Write("\n.label");
+      WriteNum(instr->InstrLabel);
+      Write(":");
       return;
     }
-
-    case NODE_STRING: {
-      String* str = (String*)expression;
-      if (expr_location->LocationSpace == LOC_NONE) {
-	expr_location->LocationSpace  = LOC_STRING;
-	expr_location->LocationOffset = str->StringLabel;
-      } else {
-	Location loc = {LOC_STRING, str->StringLabel};
-	Emit(OP_MOV, expr_location, &loc);
-      }
+    case OP_COMMENT: {
+      // Only with -comments, so it can go through stdio
+      char* text;
+      size_t size;
+      FILE* comment = open_memstream(&text, &size);
+      PrintNode(comment, instr->InstrNode, 0);
+      fclose(comment);
+
+      Write("\n; ");
+      BufferWrite(Out, text, size);
+      free(text);
       return;
     }
-
-    case NODE_REFERENCE: {
-      const char* name = ((Reference*)expression)->ReferenceName;
-
-      // Check if it's a constant
-      Cons* nodes = Consts;
-      while (nodes) {
-	Const* constant = nodes->Value;
-	if (strcmp(constant->ConstName, name) == 0)  {
-	  CodegenNumber(fn, constant->ConstValue, expr_location);
-	  return;
-	}
-	nodes = nodes->Tail;
+    case OP_JMP:
+    case OP_JNZ:
+    case OP_JZ:
+    case OP_JL:
+    case OP_JLE:
+    case OP_JG:
+    case OP_JGE: {
+      NewLine();
+      switch (op) {
+      case OP_JMP: Write("JMP "); break;
+      case OP_JNZ: Write("JNZ "); break;
+      case OP_JZ: Write("JZ "); break;
+      case OP_JL: Write("JL "); break;
+      case OP_JLE: Write("JLE "); break;
+      case OP_JG: Write("JG "); break;
+      case OP_JGE: Write("JGE "); break;
       }
-
-      // Check if it's a varaible
-      if (expr_location->LocationSpace == LOC_NONE) {
-	GetVarLocation(fn, name, expr_location, is_lvalue);
-      } else {
-	Location loc = { LOC_NONE };
-	GetVarLocation(fn, name, &loc, is_lvalue);
-	Emit(OP_MOV, expr_location, &loc);
+      Write(".label");
+      WriteNum(instr->InstrLabel);
+      return;
+    }
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_EQ:
+    case OP_NE: {
+      NewLine();
+      switch (op) {
+	case OP_LT: Write("SETL "); break;
+	case OP_LE: Write("SETLE "); break;
+	case OP_GT: Write("SETG "); break;
+	case OP_GE: Write("SETGE "); break;
+	case OP_EQ: Write("SETE "); break;
+	case OP_NE: Write("SETNE "); break;
       }
+      PrintLocationByte(dst1);
       return;
     }
-
-    case NODE_CALL: {
-      CodegenCall(fn, (Call*)expression, expr_location, is_lvalue);
+    case OP_PUSH:
+    case OP_IMUL_WIDE:
+    case OP_IDIV: {
+      NewLine();
+      Write(op == OP_PUSH ? "PUSH " : op == OP_IDIV ? "IDIV " : "IMUL ");
+      PrintLocation(src1);
+      return;
+    }
+    case OP_CQO: {
+      NewLine();
+      Write("CQO");
+      return;
+    }
+    case OP_SHL:
+    case OP_SAR:
+    case OP_SHR: {
+      NewLine();
+      Write(op == OP_SHL ? "SHL " : op == OP_SAR ? "SAR " : "SHR ");
+      PrintLocation(dst1);
+      Write(", ");
+      if (src1->LocationSpace == LOC_REGISTER) PrintLocationByte(src1);
+      else PrintLocation(src1);
+      return;
+    }
+    case OP_POP: {
+      NewLine();
+      Write("POP ");
+      PrintLocation(dst1);
+      return;
+    }
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      NewLine();
+      Write(op == OP_CALL ? "CALL " : "JMP ");
+      Write(src1->LocationName);
+      if (src1->LocationSpace == LOC_EXTERN)
+	Write(" WRT ..plt");
+      return;
+    }
+    case OP_RET: {
+      NewLine();
+      Write("RET");
+      return;
+    }
+    case OP_MOV8: {
+      NewLine();
+      Write("MOV ");
+      PrintLocationByte(dst1);
+      Write(", ");
+      PrintLocationByte(src1);
+      return;
+    }
+    case OP_MOVZX8: {
+      NewLine();
+      Write("MOVZX ");
+      PrintLocation(dst1);
+      Write(", ");
+      PrintLocationByte(src1);
       return;
     }
   }
 
-  fprintf(stderr, "Expression Type Not implemented\n");
-  exit(1);
-}
-
-static void CodegenSet(Fn* fn, Set* set) {
-
-  Location dst_location = { LOC_NONE };
-  CodegenExpression(fn, set->SetDestination, &dst_location, TRUE);
-
-  Location src_location = { LOC_NONE };
-  CodegenExpression(fn, set->SetValue, &src_location, FALSE);
-
-
-  NewLine();
-  printf("MOV QWORD r12, ");
-  PrintLocation(&src_location);
-
-  Emit(OP_MOV, &TempRegister, &dst_location);
   NewLine();
-
-  if (set->SetIsEightBit) {
-    printf("MOV BYTE [r11], r12b");
-  } else {
-    printf("MOV QWORD [r11], r12");
+  switch (op) {
+  case OP_MOV: Write("MOV "); break;
+  case OP_LEA: Write("LEA "); break;
+  case OP_ADD: Write("ADD "); break;
+  case OP_SUB: Write("SUB "); break;
+  case OP_BAND: Write("AND "); break;
+  case OP_IMUL: Write("IMUL "); break;
+  case OP_BOR: Write("OR "); break;
+  case OP_XOR: Write("XOR "); break;
+  case OP_TEST: Write("TEST "); break;
+  case OP_CMP: Write("CMP "); break;
   }
+  PrintLocation(dst1);
+  Write(", ");
+  PrintLocation(src1);
 }
 
-static void CodegenReturn(Fn* fn, Return* ret) {
-  Location loc;
-  AcquireTemp(&loc);
+static void CodegenFn(IrFn* fn) {
+  FnInstrs.InstrsCount = 0;
+  NextVReg             = 0;
+
+  for (NUM i = 0; i < fn->IrFnTempCount; i++)
+    NewVReg(fn->IrFnTempIsVariable[i]);
 
-  if (ret->ReturnValue) {
-    CodegenExpression(fn, ret->ReturnValue, &loc, FALSE);
-    Emit(OP_MOV, &ReturnLocation, &loc);
+  // Params are copied out of the argument registers first
+  for (NUM i = 0; i < fn->IrFnParamCount; i++) {
+    Location param = { LOC_VREG, i };
+    Emit(OP_MOV, &param, &ArgumentLocationsReg[i]);
   }
-  EmitRet(fn);
-}
 
-static void CodegenIf(Fn* fn, If* if_statement) {
-  NUM else_label = GetLabel();
-  NUM end_label = GetLabel();
+  for (NUM i = 0; i < fn->IrFnCodeCount; i++) {
+    if (IsTailCall(fn, i)) {
+      // The return after it is never reached
+      Location dst = { LOC_VREG, fn->IrFnCode[i].IrDst };
+      CodegenCall(&fn->IrFnCode[i], &dst, TRUE);
+      while (fn->IrFnCode[i].IrOp != IR_RET)
+        i++;
+      continue;
+    }
+    CodegenIr(&fn->IrFnCode[i]);
+  }
 
-  Location condition = { LOC_NONE };
-  CodegenExpression(fn, if_statement->IfCondition, &condition, FALSE);
+  CurrentStackOffset = -fn->IrFnSlotCount * NUM_SIZE;
+  CurrentStackOffset = AllocateRegisters(&FnInstrs, NextVReg, VRegIsVariable, CurrentStackOffset, &SavedRegisters);
 
-  Emit(OP_TEST, &condition, &condition);
-  EmitJump(OP_JZ, else_label);
+  for (Register reg = 0; reg < REG_COUNT; reg++) {
+    if (!(SavedRegisters & (1 << reg))) continue;
+    CurrentStackOffset -= NUM_SIZE;
+    SavedRegisterOffsets[reg] = CurrentStackOffset;
+  }
 
-  CodegenBlock(fn, if_statement->IfThenBlock);
-  EmitJump(OP_JMP, end_label);
-  PlaceLabel(else_label);
+  FrameSize = (-CurrentStackOffset + 15) & ~15;
 
-  if (if_statement->IfElseBlock) {
-    CodegenBlock(fn, if_statement->IfElseBlock);
+  BOOL leaf = TRUE;
+  for (NUM i = 0; i < FnInstrs.InstrsCount; i++) {
+    if (FnInstrs.Instrs[i].InstrOp == OP_CALL) leaf = FALSE;
   }
-  PlaceLabel(end_label);
-}
 
-static void CodegenWhile(Fn* fn, While* while_loop) {
-  Location condition = { LOC_NONE };
-  NUM start_label = GetLabel();
-  NUM done_label = GetLabel();
+  // A leaf whose frame fits keeps it in the red zone and never moves rsp. Otherwise rsp
+  // moves 8 more than the frame, since the return address leaves it 8 off a multiple of
+  // 16, which calls need it to be. Tail calls leave with rsp as it was on entry, so they
+  // don't count as calls.
+  FramePointer = KeepFramePointers;
+  StackAdjust  = leaf && FrameSize <= RED_ZONE_SIZE ? 0 : FrameSize + NUM_SIZE;
 
-  NUM OldContinueLabel = CurrentContinueLabel;
-  NUM OldBreakLabel = CurrentBreakLabel;
-  CurrentContinueLabel = start_label;
-  CurrentBreakLabel = done_label;
+  LegalizeFunction(&FnInstrs, &FinalInstrs);
+  if (Peephole) OptimizePeephole(&FinalInstrs);
 
-  PlaceLabel(start_label);
-  CodegenExpression(fn, while_loop->WhileCondition, &condition, FALSE);
+  if (ObjectPath) {
+    EncodeFunction(fn->IrFnName, &FinalInstrs, Encoded);
+    return;
+  }
 
-  Emit(OP_TEST, &condition, &condition);
-  EmitJump(OP_JZ, done_label);
+  Write("global ");
+  Write(fn->IrFnName);
+  Write("\n");
+  Write(fn->IrFnName);
+  Write(":");
 
-  CodegenBlock(fn, while_loop->WhileBody);
-  EmitJump(OP_JMP, start_label);
+  for (NUM i = 0; i < FinalInstrs.InstrsCount; i++)
+    PrintInstr(&FinalInstrs.Instrs[i]);
 
-  PlaceLabel(done_label);
+  Write("\n\n");
+}
 
-  CurrentContinueLabel = OldContinueLabel;
-  CurrentBreakLabel = OldBreakLabel;
+// With an object_path functions are encoded and written out as an ELF object by
+// FinishCodegen, otherwise NASM source is printed to stdout
+void BeginCodegen(CodegenOptions* options) {
+  ObjectPath        = options->OptionsObjectPath;
+  Jobs              = options->OptionsJobs;
+  Comments          = options->OptionsComments;
+  KeepFramePointers = options->OptionsFramePointers;
+  Inline            = options->OptionsInline;
+  Peephole          = options->OptionsPeephole;
+  Out               = &Output;
+  Encoded           = calloc(1, sizeof(ObjFunction));
+  if (!ObjectPath) Write("segment .text\n");
 }
 
-static void CodegenBreak(Fn* fn) {
-  NewLine();
-  printf("JMP _label%ld", CurrentBreakLabel);
+static IrFn* LowerForCodegen(Fn* fn) {
+  IrFn* ir_fn = LowerFn(fn);
+  return Inline ? InlineCalls(ir_fn) : ir_fn;
 }
 
-static void CodegenContinue(Fn* fn) {
-  NewLine();
-  printf("JMP _label%ld", CurrentContinueLabel);
+void CodegenFunction(Fn* fn) {
+  CodegenFn(LowerForCodegen(fn));
+  if (ObjectPath) AddObjFunction(Encoded);
+  if (Output.BufferCount >= OUTPUT_FLUSH_SIZE) FlushOutput();
 }
 
-static void CodegenStatement(Fn* fn, Node* statement) {
-  switch (statement->NodeType) {
-    case NODE_SET: CodegenSet(fn, (Set*)statement); return;
-    case NODE_RETURN: CodegenReturn(fn, (Return*)statement); return;
-    case NODE_IF: CodegenIf(fn, (If*)statement); return;
-    case NODE_WHILE: CodegenWhile(fn, (While*)statement); return;
-    case NODE_BREAK: CodegenBreak(fn); return;
-    case NODE_CONTINUE: CodegenContinue(fn); return;
-    case NODE_VAR: return;
+// The functions shared out between the -j workers, each generated into its own
+// NASM text or ObjFunction
+typedef struct CodegenJobs {
+  Fn** JobsFunctions;
+  NUM JobsCount;
+  NUM JobsNext; // the next function to be taken, incremented atomically
+  Buffer* JobsText;
+  ObjFunction* JobsEncoded;
+} CodegenJobs;
+
+static void* CodegenWorker(void* argument) {
+  CodegenJobs* jobs = argument;
+  SetArenaPhase(PHASE_CODEGEN);
+
+  while (TRUE) {
+    NUM i = __atomic_fetch_add(&jobs->JobsNext, 1, __ATOMIC_RELAXED);
+    if (i >= jobs->JobsCount) break;
+
+    Encoded = &jobs->JobsEncoded[i];
+    Out     = &jobs->JobsText[i];
+    CodegenFn(LowerForCodegen(jobs->JobsFunctions[i]));
   }
 
-  Location loc = { LOC_NONE };
-  CodegenExpression(fn, statement, &loc, FALSE);
+  MergeArenaStats();
+  return NULL;
 }
 
-static void CodegenBlock(Fn* fn, Block* block) {
-  Cons* statements = block->BlockStatements;
-
-  while (statements) {
-    CodegenStatement(fn, statements->Value);
-    statements = statements->Tail;
+// Generates the functions in parallel, then adds them in declaration order, so the
+// output is the same as generating them one by one
+static void CodegenParallel() {
+  NUM count = Length(Functions.ListHead);
+  if (count == 0) return;
+
+  CodegenJobs jobs = { 0 };
+  jobs.JobsFunctions = calloc(count, sizeof(Fn*));
+  jobs.JobsCount     = count;
+  jobs.JobsText      = calloc(count, sizeof(Buffer));
+  jobs.JobsEncoded   = calloc(count, sizeof(ObjFunction));
+
+  Cons* fn = Functions.ListHead;
+  for (NUM i = 0; i < count; i++, fn = fn->Tail)
+    jobs.JobsFunctions[i] = fn->Value;
+
+  // The workers only read the global symbols
+  UpdateGlobalSymbols();
+
+  NUM threads_count = Jobs < count ? Jobs : count;
+  pthread_t threads[threads_count];
+  for (NUM i = 0; i < threads_count; i++)
+    pthread_create(&threads[i], NULL, CodegenWorker, &jobs);
+  for (NUM i = 0; i < threads_count; i++)
+    pthread_join(threads[i], NULL);
+
+  for (NUM i = 0; i < count; i++) {
+    if (ObjectPath) {
+      AddObjFunction(&jobs.JobsEncoded[i]);
+      free(jobs.JobsEncoded[i].FunctionCode.BufferData);
+      free(jobs.JobsEncoded[i].FunctionRelocs);
+    }
+    else {
+      BufferWrite(&Output, jobs.JobsText[i].BufferData, jobs.JobsText[i].BufferCount);
+      free(jobs.JobsText[i].BufferData);
+      if (Output.BufferCount >= OUTPUT_FLUSH_SIZE) FlushOutput();
+    }
   }
-}
-
-static void CodegenFn(Fn* fn) {
-  printf("global %s\n", fn->FnName);
-  printf("%s:", fn->FnName);
-
-  NewLine();
-  printf("PUSH rbp");
-  NewLine();
-  printf("MOV rbp, rsp");
-
-  NUM argc = Length(fn->FnParamNames);
-
-  for (int i = 0; i < argc; i++)
-    EmitPush(&ArgumentLocationsReg[i]);
 
-  CurrentStackOffset = -GetStackFrameSize(fn);
-  NewLine();
-  printf("SUB rsp, %ld", STACK_FRAME - argc * NUM_SIZE);
-
-  CodegenBlock(fn, fn->FnBlock);
-
-  EmitRet(fn);
-
-  printf("\n\n");
+  free(jobs.JobsFunctions);
+  free(jobs.JobsText);
+  free(jobs.JobsEncoded);
 }
 
-void GlobalCodegen() {
+// Generates the functions in Functions, then the tables that functions generated
+// earlier may refer to
+void FinishCodegen() {
+  if (Inline) IndexInlineCallees();
+
+  if (Jobs > 1) {
+    CodegenParallel();
+  }
+  else {
+    Cons* fn = Functions.ListHead;
+    while (fn) {
+      CodegenFunction(fn->Value);
+      fn = fn->Tail;
+    }
+  }
   // Externs
-  Cons* efn = Externs;
+  Cons* efn = Externs.ListHead;
   while (efn) {
-    printf("extern %s\n", (const char*)efn->Value);
+    if (!ObjectPath) {
+      Write("extern ");
+      Write(efn->Value);
+      Write("\n");
+    }
     efn = efn->Tail;
   }
 
   // Uninitialized static variables
-  printf("segment .bss\n");
-  Cons* statics = StaticVariables;
+  if (!ObjectPath) Write("segment .bss\n");
+  Cons* statics = StaticVariables.ListHead;
   while (statics) {
     Var* stat = statics->Value;
-    printf("%s: resq 1\n", stat->VarName);
+    if (ObjectPath)
+      AddObjStatic(stat->VarName);
+    else {
+      Write(stat->VarName);
+      Write(": resq 1\n");
+    }
     statics = statics->Tail;
   }
 
-  // Strings
-  printf("segment .rodata\n");
-  Cons* strings = Strings;
-  NUM str_index = 0;
+  // Strings, labelled by MergeDeclarations
+  if (!ObjectPath) Write("segment .rodata\n");
+  Cons* strings = Strings.ListHead;
   while (strings) {
     String* str = strings->Value;
-    str->StringLabel = str_index;
-
+    if (ObjectPath)
+      AddObjString(str->StringLabel, str->StringStr);
+    else {
+      Write("_string");
+      WriteNum(str->StringLabel);
+      Write(": db \"");
+      Write(str->StringStr);
+      Write("\", 0\n");
+    }
     strings = strings->Tail;
-    str_index = str_index + 1;
-
-    printf("_string%ld: db \"%s\", 0\n", str->StringLabel, str->StringStr);
   }
 
-  printf("segment .text\n");
-  Cons* fn = Functions;
-  while (fn) {
-    CodegenFn((Fn*)fn->Value);
-    fn = fn->Tail;
+  if (!ObjectPath) FlushOutput();
+
+  if (ObjectPath && !WriteObject(ObjectPath)) {
+    fprintf(stderr, "%s: Failed to write object file\n", ObjectPath);
+    exit(1);
   }
 }
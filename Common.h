@@ -13,6 +13,21 @@
 
 
 typedef struct Cons Cons;
+typedef struct ConsList ConsList;
+typedef struct TokenArray TokenArray;
+typedef struct Declarations Declarations;
 
-void GlobalCodegen();
-BOOL ParseFile(Cons* tokens);
+typedef struct CodegenOptions {
+  const char* OptionsObjectPath; // NULL to print NASM to stdout
+  NUM OptionsJobs;               // threads generating functions
+  BOOL OptionsComments;          // print the source expressions in the NASM
+  BOOL OptionsFramePointers;     // set up rbp in every function
+  BOOL OptionsInline;            // inline calls to small functions
+  BOOL OptionsPeephole;          // run the peephole optimizer over the generated code
+} CodegenOptions;
+
+void BeginCodegen(CodegenOptions* options);
+void FinishCodegen();
+void PrintPeepholeStats();
+BOOL ParseFile(TokenArray* tokens, Declarations* declarations);
+void FoldConstants();
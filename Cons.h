@@ -6,9 +6,13 @@ typedef struct Cons {
   struct Cons* Tail;
 } Cons;
 
+// A list being built, with a pointer to its last cell so that Push is O(1)
+typedef struct ConsList {
+  Cons* ListHead;
+  Cons* ListLast;
+} ConsList;
 
-Cons* Append(Cons** list, void* value);
+Cons* Push(ConsList* list, const void* value);
+void Concat(ConsList* list, ConsList* other);
 NUM Length(Cons* list);
 void* Nth(Cons* list, NUM n);
-
-Cons* LexFile(char* file);
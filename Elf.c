@@ -0,0 +1,286 @@
+#include <elf.h>
+
+#include "Object.h"
+#include "Table.h"
+#include "Arena.h"
+
+Buffer ObjText;
+Buffer ObjRodata;
+NUM ObjBssSize;
+
+static Table ObjSymbols;
+static ObjSymbol** ObjSymbolList;
+static NUM ObjSymbolCount;
+static NUM ObjSymbolCapacity;
+
+static ObjSymbol SectionSymbols[OBJ_SECTION_COUNT];
+
+static ObjReloc* ObjRelocs;
+static NUM ObjRelocCount;
+static NUM ObjRelocCapacity;
+
+static NUM* StringOffsets;
+static NUM StringOffsetsCapacity;
+
+void BufferWrite(Buffer* buffer, const void* data, NUM size) {
+  if (buffer->BufferCount + size > buffer->BufferCapacity) {
+    while (buffer->BufferCount + size > buffer->BufferCapacity)
+      buffer->BufferCapacity = buffer->BufferCapacity ? buffer->BufferCapacity * 2 : 4096;
+    buffer->BufferData = realloc(buffer->BufferData, buffer->BufferCapacity);
+  }
+
+  memcpy(buffer->BufferData + buffer->BufferCount, data, size);
+  buffer->BufferCount += size;
+}
+
+ObjSymbol* GetObjSymbol(const char* name) {
+  ObjSymbol* symbol = TableGet(&ObjSymbols, name);
+  if (symbol) return symbol;
+
+  BOOL was_permanent = SetArenaPermanent(TRUE);
+  symbol             = ArenaAlloc(sizeof(ObjSymbol));
+  SetArenaPermanent(was_permanent);
+  memset(symbol, 0, sizeof(ObjSymbol));
+  symbol->ObjSymbolName   = name;
+  symbol->ObjSymbolGlobal = TRUE;
+  TablePut(&ObjSymbols, name, symbol);
+
+  if (ObjSymbolCount == ObjSymbolCapacity) {
+    ObjSymbolCapacity = ObjSymbolCapacity ? ObjSymbolCapacity * 2 : 256;
+    ObjSymbolList     = realloc(ObjSymbolList, ObjSymbolCapacity * sizeof(ObjSymbol*));
+  }
+  ObjSymbolList[ObjSymbolCount++] = symbol;
+  return symbol;
+}
+
+ObjSymbol* GetSectionSymbol(ObjSection section) {
+  SectionSymbols[section].ObjSymbolSection = section;
+  return &SectionSymbols[section];
+}
+
+void AddObjString(NUM label, const char* str) {
+  if (label >= StringOffsetsCapacity) {
+    StringOffsetsCapacity = (label + 1) * 2;
+    StringOffsets         = realloc(StringOffsets, StringOffsetsCapacity * sizeof(NUM));
+  }
+
+  StringOffsets[label] = ObjRodata.BufferCount;
+  BufferWrite(&ObjRodata, str, strlen(str) + 1);
+}
+
+
+void AddObjStatic(const char* name) {
+  ObjSymbol* symbol        = GetObjSymbol(name);
+  symbol->ObjSymbolGlobal  = FALSE;
+  symbol->ObjSymbolSection = OBJ_BSS;
+  symbol->ObjSymbolValue   = ObjBssSize;
+  ObjBssSize += 8;
+}
+
+void AddObjReloc(NUM offset, NUM type, ObjSymbol* symbol, NUM addend) {
+  if (ObjRelocCount == ObjRelocCapacity) {
+    ObjRelocCapacity = ObjRelocCapacity ? ObjRelocCapacity * 2 : 1024;
+    ObjRelocs        = realloc(ObjRelocs, ObjRelocCapacity * sizeof(ObjReloc));
+  }
+
+  ObjReloc* reloc    = &ObjRelocs[ObjRelocCount++];
+  reloc->RelocOffset = offset;
+  reloc->RelocType   = type;
+  reloc->RelocSymbol = symbol;
+  reloc->RelocAddend = addend;
+  reloc->RelocString = -1;
+  reloc->RelocName   = NULL;
+}
+
+void AddObjStringReloc(NUM offset, NUM label, NUM addend) {
+  AddObjReloc(offset, R_X86_64_PC32, GetSectionSymbol(OBJ_RODATA), addend);
+  ObjRelocs[ObjRelocCount - 1].RelocString = label;
+}
+
+void AddObjFunction(ObjFunction* function) {
+  NUM base                 = ObjText.BufferCount;
+  ObjSymbol* symbol        = GetObjSymbol(function->FunctionName);
+  symbol->ObjSymbolSection = OBJ_TEXT;
+  symbol->ObjSymbolValue   = base;
+
+  for (NUM i = 0; i < function->FunctionRelocsCount; i++) {
+    ObjReloc* reloc = &function->FunctionRelocs[i];
+    if (reloc->RelocString >= 0)
+      AddObjStringReloc(base + reloc->RelocOffset, reloc->RelocString, reloc->RelocAddend);
+    else
+      AddObjReloc(base + reloc->RelocOffset, reloc->RelocType, GetObjSymbol(reloc->RelocName),
+                  reloc->RelocAddend);
+  }
+
+  BufferWrite(&ObjText, function->FunctionCode.BufferData, function->FunctionCode.BufferCount);
+}
+
+enum ElfSectionEnum {
+  ELF_NULL,
+  ELF_TEXT,
+  ELF_RODATA,
+  ELF_BSS,
+  ELF_SYMTAB,
+  ELF_STRTAB,
+  ELF_RELA_TEXT,
+  ELF_SHSTRTAB,
+  ELF_NOTE_GNU_STACK,
+
+  ELF_SECTION_COUNT,
+};
+
+static const char* ElfSectionNames[ELF_SECTION_COUNT] = {
+  "", ".text", ".rodata", ".bss", ".symtab", ".strtab", ".rela.text", ".shstrtab", ".note.GNU-stack",
+};
+
+static void AddElfSymbol(Buffer* symtab, Buffer* strtab, ObjSymbol* symbol, NUM type) {
+  Elf64_Sym sym = { 0 };
+  if (symbol->ObjSymbolName) {
+    sym.st_name = strtab->BufferCount;
+    BufferWrite(strtab, symbol->ObjSymbolName, strlen(symbol->ObjSymbolName) + 1);
+  }
+  sym.st_info  = ELF64_ST_INFO(symbol->ObjSymbolGlobal ? STB_GLOBAL : STB_LOCAL, type);
+  sym.st_shndx = symbol->ObjSymbolSection; // OBJ_* match the ELF_* section numbers
+  sym.st_value = symbol->ObjSymbolValue;
+
+  symbol->ObjSymbolIndex = symtab->BufferCount / sizeof(Elf64_Sym);
+  BufferWrite(symtab, &sym, sizeof(sym));
+}
+
+static NUM GetSymbolType(ObjSymbol* symbol) {
+  switch (symbol->ObjSymbolSection) {
+    case OBJ_TEXT: return STT_FUNC;
+    case OBJ_BSS: return STT_OBJECT;
+  }
+  return STT_NOTYPE;
+}
+
+BOOL WriteObject(const char* path) {
+  Buffer symtab   = { 0 };
+  Buffer strtab   = { 0 };
+  Buffer rela     = { 0 };
+  Buffer shstrtab = { 0 };
+
+  // Locals have to come before globals
+  Elf64_Sym null_symbol = { 0 };
+  BufferWrite(&symtab, &null_symbol, sizeof(null_symbol));
+  BufferWrite(&strtab, "", 1);
+
+  for (ObjSection section = OBJ_TEXT; section < OBJ_SECTION_COUNT; section++)
+    AddElfSymbol(&symtab, &strtab, GetSectionSymbol(section), STT_SECTION);
+
+  for (NUM i = 0; i < ObjSymbolCount; i++) {
+    if (!ObjSymbolList[i]->ObjSymbolGlobal)
+      AddElfSymbol(&symtab, &strtab, ObjSymbolList[i], GetSymbolType(ObjSymbolList[i]));
+  }
+  NUM first_global = symtab.BufferCount / sizeof(Elf64_Sym);
+
+  for (NUM i = 0; i < ObjSymbolCount; i++) {
+    if (ObjSymbolList[i]->ObjSymbolGlobal)
+      AddElfSymbol(&symtab, &strtab, ObjSymbolList[i], GetSymbolType(ObjSymbolList[i]));
+  }
+
+  for (NUM i = 0; i < ObjRelocCount; i++) {
+    ObjReloc* reloc = &ObjRelocs[i];
+    Elf64_Rela entry;
+    entry.r_offset = reloc->RelocOffset;
+    entry.r_info   = ELF64_R_INFO(reloc->RelocSymbol->ObjSymbolIndex, reloc->RelocType);
+    entry.r_addend = reloc->RelocAddend;
+    if (reloc->RelocString >= 0) entry.r_addend += StringOffsets[reloc->RelocString];
+    BufferWrite(&rela, &entry, sizeof(entry));
+  }
+
+  Elf64_Shdr sections[ELF_SECTION_COUNT] = { 0 };
+  for (NUM i = 0; i < ELF_SECTION_COUNT; i++) {
+    sections[i].sh_name = shstrtab.BufferCount;
+    BufferWrite(&shstrtab, ElfSectionNames[i], strlen(ElfSectionNames[i]) + 1);
+  }
+
+  /* clang-format off */
+  Buffer* contents[ELF_SECTION_COUNT] = {
+    NULL, &ObjText, &ObjRodata, NULL, &symtab, &strtab, &rela, &shstrtab, NULL,
+  };
+  /* clang-format on */
+
+  sections[ELF_TEXT].sh_type      = SHT_PROGBITS;
+  sections[ELF_TEXT].sh_flags     = SHF_ALLOC | SHF_EXECINSTR;
+  sections[ELF_TEXT].sh_addralign = 16;
+
+  sections[ELF_RODATA].sh_type      = SHT_PROGBITS;
+  sections[ELF_RODATA].sh_flags     = SHF_ALLOC;
+  sections[ELF_RODATA].sh_addralign = 1;
+
+  sections[ELF_BSS].sh_type      = SHT_NOBITS;
+  sections[ELF_BSS].sh_flags     = SHF_ALLOC | SHF_WRITE;
+  sections[ELF_BSS].sh_addralign = 8;
+  sections[ELF_BSS].sh_size      = ObjBssSize;
+
+  sections[ELF_SYMTAB].sh_type      = SHT_SYMTAB;
+  sections[ELF_SYMTAB].sh_link      = ELF_STRTAB;
+  sections[ELF_SYMTAB].sh_info      = first_global;
+  sections[ELF_SYMTAB].sh_entsize   = sizeof(Elf64_Sym);
+  sections[ELF_SYMTAB].sh_addralign = 8;
+
+  sections[ELF_STRTAB].sh_type      = SHT_STRTAB;
+  sections[ELF_STRTAB].sh_addralign = 1;
+
+  sections[ELF_RELA_TEXT].sh_type      = SHT_RELA;
+  sections[ELF_RELA_TEXT].sh_flags     = SHF_INFO_LINK;
+  sections[ELF_RELA_TEXT].sh_link      = ELF_SYMTAB;
+  sections[ELF_RELA_TEXT].sh_info      = ELF_TEXT;
+  sections[ELF_RELA_TEXT].sh_entsize   = sizeof(Elf64_Rela);
+  sections[ELF_RELA_TEXT].sh_addralign = 8;
+
+  sections[ELF_SHSTRTAB].sh_type      = SHT_STRTAB;
+  sections[ELF_SHSTRTAB].sh_addralign = 1;
+
+  sections[ELF_NOTE_GNU_STACK].sh_type      = SHT_PROGBITS;
+  sections[ELF_NOTE_GNU_STACK].sh_addralign = 1;
+
+  // Section contents follow the header, each aligned to 16, then the section headers
+  NUM offset = sizeof(Elf64_Ehdr);
+  for (NUM i = 1; i < ELF_SECTION_COUNT; i++) {
+    offset = (offset + 15) & ~15;
+    sections[i].sh_offset = offset;
+    if (contents[i]) {
+      sections[i].sh_size = contents[i]->BufferCount;
+      offset += contents[i]->BufferCount;
+    }
+  }
+  offset = (offset + 15) & ~15;
+
+  Elf64_Ehdr header = { 0 };
+  memcpy(header.e_ident, ELFMAG, SELFMAG);
+  header.e_ident[EI_CLASS]   = ELFCLASS64;
+  header.e_ident[EI_DATA]    = ELFDATA2LSB;
+  header.e_ident[EI_VERSION] = EV_CURRENT;
+  header.e_ident[EI_OSABI]   = ELFOSABI_SYSV;
+  header.e_type              = ET_REL;
+  header.e_machine           = EM_X86_64;
+  header.e_version           = EV_CURRENT;
+  header.e_shoff             = offset;
+  header.e_ehsize            = sizeof(Elf64_Ehdr);
+  header.e_shentsize         = sizeof(Elf64_Shdr);
+  header.e_shnum             = ELF_SECTION_COUNT;
+  header.e_shstrndx          = ELF_SHSTRTAB;
+
+  FILE* file = fopen(path, "wb");
+  if (!file) return FALSE;
+
+  static const uint8_t padding[16] = { 0 };
+  fwrite(&header, sizeof(header), 1, file);
+  NUM written = sizeof(header);
+
+  for (NUM i = 1; i < ELF_SECTION_COUNT; i++) {
+    fwrite(padding, 1, sections[i].sh_offset - written, file);
+    written = sections[i].sh_offset;
+    if (contents[i]) {
+      fwrite(contents[i]->BufferData, 1, contents[i]->BufferCount, file);
+      written += contents[i]->BufferCount;
+    }
+  }
+  fwrite(padding, 1, offset - written, file);
+  fwrite(sections, sizeof(sections), 1, file);
+
+  return fclose(file) == 0;
+}
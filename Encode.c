@@ -0,0 +1,407 @@
+#include <elf.h>
+
+#include "Asm.h"
+#include "Object.h"
+
+// Encodes the legalized instructions of a function (see LegalizeFunction in Codegen.c)
+// into an ObjFunction. Operands are registers, constants, rbp- or rsp-relative slots,
+// [register], [register + register * scale] as the source of an LEA, statics/externs
+// addressed RIP-relative, and string/symbol addresses which only appear as the source
+// of a MOV to a register and become a LEA.
+
+typedef struct LabelFixup {
+  NUM FixupOffset; // of the rel32 to patch
+  NUM FixupLabel;
+} LabelFixup;
+
+// Per thread, functions are encoded in parallel with -j
+static __thread ObjFunction* Function;
+
+static __thread NUM* LabelOffsets;
+static __thread NUM LabelOffsetsCapacity;
+
+static __thread LabelFixup* Fixups;
+static __thread NUM FixupsCount;
+static __thread NUM FixupsCapacity;
+
+/* clang-format off */
+// /digit of the 0x81/0x83 immediate group, and the opcodes of the r/m,reg and reg,r/m forms
+static const uint8_t ArithmeticDigit[] = {
+  [OP_ADD] = 0, [OP_BOR] = 1, [OP_BAND] = 4, [OP_SUB] = 5, [OP_XOR] = 6, [OP_CMP] = 7,
+};
+static const uint8_t ArithmeticRmReg[] = {
+  [OP_ADD] = 0x01, [OP_BOR] = 0x09, [OP_BAND] = 0x21, [OP_SUB] = 0x29, [OP_XOR] = 0x31, [OP_CMP] = 0x39,
+  [OP_TEST] = 0x85,
+};
+static const uint8_t ArithmeticRegRm[] = {
+  [OP_ADD] = 0x03, [OP_BOR] = 0x0B, [OP_BAND] = 0x23, [OP_SUB] = 0x2B, [OP_XOR] = 0x33, [OP_CMP] = 0x3B,
+  [OP_TEST] = 0x85,
+};
+static const uint8_t JumpConditions[] = {
+  [OP_JZ] = 0x84, [OP_JNZ] = 0x85, [OP_JL] = 0x8C, [OP_JGE] = 0x8D, [OP_JLE] = 0x8E, [OP_JG] = 0x8F,
+};
+static const uint8_t SetConditions[] = {
+  [OP_EQ] = 0x94, [OP_NE] = 0x95, [OP_LT] = 0x9C, [OP_GE] = 0x9D, [OP_LE] = 0x9E, [OP_GT] = 0x9F,
+};
+// /digit of the 0xC1 (by an immediate) and 0xD3 (by cl) shift group
+static const uint8_t ShiftDigit[] = {
+  [OP_SHL] = 4, [OP_SHR] = 5, [OP_SAR] = 7,
+};
+/* clang-format on */
+
+// A relocation of the next 4 bytes against the symbol called name, or string label if name is NULL
+static void AddReloc(NUM type, const char* name, NUM label, NUM addend) {
+  ObjFunction* f = Function;
+  if (f->FunctionRelocsCount == f->FunctionRelocsCapacity) {
+    f->FunctionRelocsCapacity = f->FunctionRelocsCapacity ? f->FunctionRelocsCapacity * 2 : 64;
+    f->FunctionRelocs         = realloc(f->FunctionRelocs, f->FunctionRelocsCapacity * sizeof(ObjReloc));
+  }
+
+  ObjReloc* reloc    = &f->FunctionRelocs[f->FunctionRelocsCount++];
+  reloc->RelocOffset = f->FunctionCode.BufferCount;
+  reloc->RelocType   = type;
+  reloc->RelocSymbol = NULL;
+  reloc->RelocAddend = addend;
+  reloc->RelocString = name ? -1 : label;
+  reloc->RelocName   = name;
+}
+
+static void EmitByte(NUM byte) {
+  uint8_t b = byte;
+  BufferWrite(&Function->FunctionCode, &b, 1);
+}
+
+static void EmitInt32(NUM value) {
+  int32_t v = value;
+  BufferWrite(&Function->FunctionCode, &v, 4);
+}
+
+static void EmitInt64(NUM value) {
+  int64_t v = value;
+  BufferWrite(&Function->FunctionCode, &v, 8);
+}
+
+static BOOL FitsInt8(NUM value) {
+  return value >= -128 && value <= 127;
+}
+
+static BOOL IsRegister(Location* loc) {
+  return loc->LocationSpace == LOC_REGISTER;
+}
+
+static NUM GetBaseRegister(Location* loc) {
+  if (loc->LocationSpace == LOC_REGISTER || loc->LocationSpace == LOC_INDIRECT) return loc->LocationOffset;
+  if (loc->LocationSpace == LOC_SCALED) return loc->LocationOffset;
+  if (loc->LocationSpace == LOC_RBP_RELATIVE) return REG_RBP;
+  if (loc->LocationSpace == LOC_RSP_RELATIVE) return REG_RSP;
+  return 0;
+}
+
+// REX, opcode, ModRM and whatever SIB, displacement and relocation the r/m operand needs.
+// imm_size is the size of the immediate that follows, RIP-relative displacements are
+// relative to the end of the instruction.
+static void EncodeModRM(const uint8_t* opcode, NUM opcode_size, BOOL wide, BOOL byte_operands, NUM reg, Location* rm,
+                        NUM imm_size) {
+  NUM base = GetBaseRegister(rm);
+  NUM rex  = 0x40 | (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (base >= 8 ? 1 : 0);
+  if (rm->LocationSpace == LOC_SCALED && base >= 8) rex |= 2; // the index is the same register
+
+  // spl, bpl, sil and dil only exist with a REX prefix, without one they're ah, ch, dh and bh
+  BOOL byte_reg  = byte_operands && ((reg >= 4 && reg < 8) || (IsRegister(rm) && base >= 4 && base < 8));
+  BOOL needs_rex = rex != 0x40 || byte_reg;
+  if (needs_rex) EmitByte(rex);
+
+  for (NUM i = 0; i < opcode_size; i++)
+    EmitByte(opcode[i]);
+
+  NUM reg_bits = (reg & 7) << 3;
+
+  switch (rm->LocationSpace) {
+    case LOC_REGISTER: {
+      EmitByte(0xC0 | reg_bits | (base & 7));
+      return;
+    }
+    case LOC_RBP_RELATIVE: {
+      if (FitsInt8(rm->LocationOffset)) {
+	EmitByte(0x40 | reg_bits | 5);
+	EmitByte(rm->LocationOffset);
+      } else {
+	EmitByte(0x80 | reg_bits | 5);
+	EmitInt32(rm->LocationOffset);
+      }
+      return;
+    }
+    case LOC_RSP_RELATIVE: {
+      // rsp as a base needs a SIB byte
+      if (rm->LocationOffset == 0) {
+	EmitByte(reg_bits | 4);
+	EmitByte(0x24);
+      } else if (FitsInt8(rm->LocationOffset)) {
+	EmitByte(0x44 | reg_bits);
+	EmitByte(0x24);
+	EmitByte(rm->LocationOffset);
+      } else {
+	EmitByte(0x84 | reg_bits);
+	EmitByte(0x24);
+	EmitInt32(rm->LocationOffset);
+      }
+      return;
+    }
+    case LOC_INDIRECT: {
+      if ((base & 7) == 5) {
+	// [rbp] and [r13] can only be encoded with a displacement
+	EmitByte(0x40 | reg_bits | 5);
+	EmitByte(0);
+      } else if ((base & 7) == 4) {
+	// [rsp] and [r12] need a SIB byte
+	EmitByte(reg_bits | 4);
+	EmitByte(0x24);
+      } else {
+	EmitByte(reg_bits | (base & 7));
+      }
+      return;
+    }
+    case LOC_SCALED: {
+      // A SIB byte with the register as both base and index
+      NUM scale_bits = rm->LocationScale == 8 ? 3 : rm->LocationScale == 4 ? 2 : 1;
+      NUM sib        = (scale_bits << 6) | ((base & 7) << 3) | (base & 7);
+      if ((base & 7) == 5) {
+	// rbp and r13 as the base need a displacement
+	EmitByte(0x44 | reg_bits);
+	EmitByte(sib);
+	EmitByte(0);
+      } else {
+	EmitByte(0x04 | reg_bits);
+	EmitByte(sib);
+      }
+      return;
+    }
+    case LOC_STATIC:
+    case LOC_EXTERN:
+    case LOC_SYMBOL:
+    case LOC_STRING: {
+      EmitByte(reg_bits | 5);
+
+      NUM addend = -4 - imm_size;
+      if (rm->LocationSpace == LOC_STRING)
+	AddReloc(R_X86_64_PC32, NULL, rm->LocationOffset, addend);
+      else
+	AddReloc(R_X86_64_PC32, rm->LocationName, 0, addend);
+      EmitInt32(0);
+      return;
+    }
+  }
+
+  fprintf(stderr, "Can't encode operand %ld\n", rm->LocationSpace);
+  exit(1);
+}
+
+static void Encode1(uint8_t opcode, BOOL wide, NUM reg, Location* rm, NUM imm_size) {
+  EncodeModRM(&opcode, 1, wide, FALSE, reg, rm, imm_size);
+}
+
+static void EncodeMov(Location* dst, Location* src) {
+  switch (src->LocationSpace) {
+    case LOC_CONSTANT: {
+      NUM value = src->LocationOffset;
+      if (IsRegister(dst) && (value < INT32_MIN || value > INT32_MAX)) {
+	EmitByte(0x48 | (dst->LocationOffset >= 8 ? 1 : 0));
+	EmitByte(0xB8 + (dst->LocationOffset & 7));
+	EmitInt64(value);
+      } else {
+	Encode1(0xC7, TRUE, 0, dst, 4);
+	EmitInt32(value);
+      }
+      return;
+    }
+    case LOC_STRING:
+    case LOC_SYMBOL: {
+      // Addresses are loaded RIP-relative
+      Encode1(0x8D, TRUE, dst->LocationOffset, src, 0);
+      return;
+    }
+    case LOC_REGISTER: {
+      Encode1(0x89, TRUE, src->LocationOffset, dst, 0);
+      return;
+    }
+  }
+
+  Encode1(0x8B, TRUE, dst->LocationOffset, src, 0);
+}
+
+static void EncodeArithmetic(Operator op, Location* dst, Location* src) {
+  if (src->LocationSpace == LOC_CONSTANT) {
+    NUM value = src->LocationOffset;
+    if (op == OP_TEST) {
+      Encode1(0xF7, TRUE, 0, dst, 4);
+      EmitInt32(value);
+    } else if (FitsInt8(value)) {
+      Encode1(0x83, TRUE, ArithmeticDigit[op], dst, 1);
+      EmitByte(value);
+    } else {
+      Encode1(0x81, TRUE, ArithmeticDigit[op], dst, 4);
+      EmitInt32(value);
+    }
+    return;
+  }
+
+  if (IsRegister(src)) {
+    Encode1(ArithmeticRmReg[op], TRUE, src->LocationOffset, dst, 0);
+  } else {
+    Encode1(ArithmeticRegRm[op], TRUE, dst->LocationOffset, src, 0);
+  }
+}
+
+// IMUL into a register, by an immediate it's the three operand form with the register twice
+static void EncodeImul(Location* dst, Location* src) {
+  if (src->LocationSpace == LOC_CONSTANT) {
+    NUM value = src->LocationOffset;
+    if (FitsInt8(value)) {
+      Encode1(0x6B, TRUE, dst->LocationOffset, dst, 1);
+      EmitByte(value);
+    } else {
+      Encode1(0x69, TRUE, dst->LocationOffset, dst, 4);
+      EmitInt32(value);
+    }
+    return;
+  }
+
+  uint8_t opcode[] = { 0x0F, 0xAF };
+  EncodeModRM(opcode, 2, TRUE, FALSE, dst->LocationOffset, src, 0);
+}
+
+static void EncodeShift(Operator op, Location* dst, Location* src) {
+  if (src->LocationSpace == LOC_CONSTANT) {
+    Encode1(0xC1, TRUE, ShiftDigit[op], dst, 1);
+    EmitByte(src->LocationOffset);
+  } else {
+    Encode1(0xD3, TRUE, ShiftDigit[op], dst, 0);
+  }
+}
+
+static void RecordLabel(NUM label) {
+  if (label >= LabelOffsetsCapacity) {
+    LabelOffsetsCapacity = (label + 1) * 2;
+    LabelOffsets         = realloc(LabelOffsets, LabelOffsetsCapacity * sizeof(NUM));
+  }
+  LabelOffsets[label] = Function->FunctionCode.BufferCount;
+}
+
+static void EmitLabelReference(NUM label) {
+  if (FixupsCount == FixupsCapacity) {
+    FixupsCapacity = FixupsCapacity ? FixupsCapacity * 2 : 256;
+    Fixups         = realloc(Fixups, FixupsCapacity * sizeof(LabelFixup));
+  }
+
+  Fixups[FixupsCount].FixupOffset = Function->FunctionCode.BufferCount;
+  Fixups[FixupsCount].FixupLabel  = label;
+  FixupsCount++;
+  EmitInt32(0);
+}
+
+static void EncodeInstr(Instr* instr) {
+  Operator op   = instr->InstrOp;
+  Location* dst = &instr->InstrDst;
+  Location* src = &instr->InstrSrc;
+
+  switch (op) {
+    case OP_COMMENT: return;
+    case OP_LABEL: RecordLabel(instr->InstrLabel); return;
+    case OP_JMP: {
+      EmitByte(0xE9);
+      EmitLabelReference(instr->InstrLabel);
+      return;
+    }
+    case OP_JZ:
+    case OP_JNZ:
+    case OP_JL:
+    case OP_JLE:
+    case OP_JG:
+    case OP_JGE: {
+      EmitByte(0x0F);
+      EmitByte(JumpConditions[op]);
+      EmitLabelReference(instr->InstrLabel);
+      return;
+    }
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      EmitByte(op == OP_CALL ? 0xE8 : 0xE9);
+      AddReloc(R_X86_64_PLT32, src->LocationName, 0, -4);
+      EmitInt32(0);
+      return;
+    }
+    case OP_RET: EmitByte(0xC3); return;
+    case OP_PUSH:
+    case OP_POP: {
+      Location* reg = op == OP_PUSH ? src : dst;
+      if (reg->LocationOffset >= 8) EmitByte(0x41);
+      EmitByte((op == OP_PUSH ? 0x50 : 0x58) + (reg->LocationOffset & 7));
+      return;
+    }
+    case OP_IMUL_WIDE: Encode1(0xF7, TRUE, 5, src, 0); return;
+    case OP_IDIV: Encode1(0xF7, TRUE, 7, src, 0); return;
+    case OP_CQO: {
+      EmitByte(0x48);
+      EmitByte(0x99);
+      return;
+    }
+    case OP_IMUL: EncodeImul(dst, src); return;
+    case OP_SHL:
+    case OP_SAR:
+    case OP_SHR: EncodeShift(op, dst, src); return;
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_EQ:
+    case OP_NE: {
+      uint8_t opcode[] = { 0x0F, SetConditions[op] };
+      EncodeModRM(opcode, 2, FALSE, TRUE, 0, dst, 0);
+      return;
+    }
+    case OP_MOVZX8: {
+      uint8_t opcode[] = { 0x0F, 0xB6 };
+      EncodeModRM(opcode, 2, TRUE, TRUE, dst->LocationOffset, src, 0);
+      return;
+    }
+    case OP_MOV8: {
+      if (IsRegister(src)) {
+	uint8_t opcode = 0x88;
+	EncodeModRM(&opcode, 1, FALSE, TRUE, src->LocationOffset, dst, 0);
+      } else {
+	uint8_t opcode = 0x8A;
+	EncodeModRM(&opcode, 1, FALSE, TRUE, dst->LocationOffset, src, 0);
+      }
+      return;
+    }
+    case OP_MOV: EncodeMov(dst, src); return;
+    case OP_LEA: Encode1(0x8D, TRUE, dst->LocationOffset, src, 0); return;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_BAND:
+    case OP_BOR:
+    case OP_XOR:
+    case OP_CMP:
+    case OP_TEST: EncodeArithmetic(op, dst, src); return;
+  }
+
+  fprintf(stderr, "Can't encode instruction %ld\n", op);
+  exit(1);
+}
+
+void EncodeFunction(const char* name, InstrList* list, ObjFunction* out) {
+  Function                           = out;
+  Function->FunctionName             = name;
+  Function->FunctionCode.BufferCount = 0;
+  Function->FunctionRelocsCount      = 0;
+
+  FixupsCount = 0;
+  for (NUM i = 0; i < list->InstrsCount; i++)
+    EncodeInstr(&list->Instrs[i]);
+
+  // Jumps are relative to the end of their rel32
+  for (NUM i = 0; i < FixupsCount; i++) {
+    int32_t rel = LabelOffsets[Fixups[i].FixupLabel] - (Fixups[i].FixupOffset + 4);
+    memcpy(Function->FunctionCode.BufferData + Fixups[i].FixupOffset, &rel, 4);
+  }
+}
@@ -0,0 +1,263 @@
+#include "Node.h"
+#include "ProgramData.h"
+#include "Table.h"
+#include "Arena.h"
+
+// Constant folding and algebraic simplification over the AST, run between
+// ParseFile and codegen. Const references are replaced with their values,
+// operators with constant operands with their result, and identities like
+// x + 0, x * 1 and x & 0 with their simpler form.
+
+// Consts by name, the last one in Consts that's been added
+static Table ConstValues;
+static Cons* LastConst;
+
+// Params and locals of the current function, they shadow consts
+static Table LocalNames;
+
+static BOOL IsNumber(Node* node, NUM value) {
+  return node->NodeType == NODE_NUMBER && ((Number*)node)->NumberValue == value;
+}
+
+static Node* MakeNumber(NUM value) {
+  Number* num      = ArenaAlloc(sizeof(Number));
+  num->NodeType    = NODE_NUMBER;
+  num->NumberValue = value;
+  return (Node*)num;
+}
+
+// Whether evaluating the node can do anything other than compute its value
+static BOOL HasSideEffects(Node* node) {
+  switch (node->NodeType) {
+    case NODE_BINARY: {
+      Binary* binary = (Binary*)node;
+      return HasSideEffects(binary->BinaryLeft) || HasSideEffects(binary->BinaryRight);
+    }
+    case NODE_UNARY: return HasSideEffects(((Unary*)node)->UnaryOperand);
+    case NODE_CALL: {
+      // Intrinsics only read memory
+      Call* call = (Call*)node;
+      if (call->CallIntrinsic == INTRINSIC_NONE) return TRUE;
+
+      Cons* arg = call->CallArguments;
+      while (arg) {
+	if (HasSideEffects(arg->Value)) return TRUE;
+	arg = arg->Tail;
+      }
+      return FALSE;
+    }
+  }
+  return FALSE;
+}
+
+// Whether lhs op rhs can be worked out here, dividing by 0 is left to fail when it runs
+static BOOL CanEvaluate(BinaryOperator op, NUM lhs, NUM rhs) {
+  if (op != BINARY_DIV && op != BINARY_MOD) return TRUE;
+  return rhs != 0 && !(lhs == INT64_MIN && rhs == -1);
+}
+
+// Arithmetic wraps and shift counts are taken mod 64, like x86 does
+static NUM Evaluate(BinaryOperator op, NUM lhs, NUM rhs) {
+  switch (op) {
+    case BINARY_ADD: return (NUM)((uint64_t)lhs + (uint64_t)rhs);
+    case BINARY_SUB: return (NUM)((uint64_t)lhs - (uint64_t)rhs);
+    case BINARY_BAND: return lhs & rhs;
+    case BINARY_BOR: return lhs | rhs;
+    case BINARY_MUL: return (NUM)((uint64_t)lhs * (uint64_t)rhs);
+    case BINARY_DIV: return lhs / rhs;
+    case BINARY_MOD: return lhs % rhs;
+    case BINARY_SHL: return (NUM)((uint64_t)lhs << (rhs & 63));
+    case BINARY_SAR: return lhs >> (rhs & 63);
+    case BINARY_SHR: return (NUM)((uint64_t)lhs >> (rhs & 63));
+    case BINARY_GT: return lhs > rhs;
+    case BINARY_LT: return lhs < rhs;
+    case BINARY_GE: return lhs >= rhs;
+    case BINARY_LE: return lhs <= rhs;
+    case BINARY_EQ: return lhs == rhs;
+    case BINARY_NE: return lhs != rhs;
+    case BINARY_AND: return lhs && rhs;
+    case BINARY_OR: return lhs || rhs;
+  }
+  return 0;
+}
+
+static Node* FoldExpression(Node* node);
+
+static Node* FoldCall(Call* call) {
+  Cons* arg = call->CallArguments;
+  while (arg) {
+    arg->Value = FoldExpression(arg->Value);
+    arg        = arg->Tail;
+  }
+  return (Node*)call;
+}
+
+static Node* FoldUnary(Unary* unary) {
+  unary->UnaryOperand = FoldExpression(unary->UnaryOperand);
+  if (unary->UnaryOperand->NodeType != NODE_NUMBER) return (Node*)unary;
+
+  NUM value = ((Number*)unary->UnaryOperand)->NumberValue;
+  return MakeNumber(unary->UnaryOperator == UNARY_NEG ? (NUM)(0 - (uint64_t)value) : !value);
+}
+
+static Node* FoldBinary(Binary* binary) {
+  binary->BinaryLeft  = FoldExpression(binary->BinaryLeft);
+  binary->BinaryRight = FoldExpression(binary->BinaryRight);
+
+  Node* lhs         = binary->BinaryLeft;
+  Node* rhs         = binary->BinaryRight;
+  BinaryOperator op = binary->BinaryOperator;
+  if (op == BINARY_ARROW) return (Node*)binary;
+
+  if (lhs->NodeType == NODE_NUMBER && rhs->NodeType == NODE_NUMBER) {
+    NUM lhs_value = ((Number*)lhs)->NumberValue;
+    NUM rhs_value = ((Number*)rhs)->NumberValue;
+    if (CanEvaluate(op, lhs_value, rhs_value)) return MakeNumber(Evaluate(op, lhs_value, rhs_value));
+    return (Node*)binary;
+  }
+
+  switch (op) {
+    case BINARY_ADD:
+    case BINARY_BOR: {
+      if (IsNumber(rhs, 0)) return lhs;
+      if (IsNumber(lhs, 0)) return rhs;
+      break;
+    }
+    case BINARY_SUB:
+    case BINARY_SHL:
+    case BINARY_SAR:
+    case BINARY_SHR: {
+      if (IsNumber(rhs, 0)) return lhs;
+      break;
+    }
+    case BINARY_DIV: {
+      if (IsNumber(rhs, 1)) return lhs;
+      break;
+    }
+    case BINARY_MOD: {
+      if (IsNumber(rhs, 1) && !HasSideEffects(lhs)) return MakeNumber(0);
+      break;
+    }
+    case BINARY_MUL: {
+      if (IsNumber(rhs, 1)) return lhs;
+      if (IsNumber(lhs, 1)) return rhs;
+      if (IsNumber(rhs, 0) && !HasSideEffects(lhs)) return rhs;
+      if (IsNumber(lhs, 0) && !HasSideEffects(rhs)) return lhs;
+      break;
+    }
+    case BINARY_BAND: {
+      if (IsNumber(rhs, 0) && !HasSideEffects(lhs)) return rhs;
+      if (IsNumber(lhs, 0) && !HasSideEffects(rhs)) return lhs;
+      break;
+    }
+  }
+
+  return (Node*)binary;
+}
+
+static Node* FoldExpression(Node* node) {
+  switch (node->NodeType) {
+    case NODE_REFERENCE: {
+      const char* name = ((Reference*)node)->ReferenceName;
+      if (TableGet(&LocalNames, name)) return node;
+
+      Const* constant = TableGet(&ConstValues, name);
+      if (constant) return MakeNumber(constant->ConstValue);
+      return node;
+    }
+    case NODE_CALL: return FoldCall((Call*)node);
+    case NODE_BINARY: return FoldBinary((Binary*)node);
+    case NODE_UNARY: return FoldUnary((Unary*)node);
+  }
+  return node;
+}
+
+static void FoldBlock(Block* block);
+
+static Node* FoldStatement(Node* statement) {
+  switch (statement->NodeType) {
+    case NODE_SET: {
+      Set* set = (Set*)statement;
+      // A name that's written to stays a name, even if there's a const called that
+      if (set->SetDestination->NodeType != NODE_REFERENCE)
+	set->SetDestination = FoldExpression(set->SetDestination);
+      set->SetValue = FoldExpression(set->SetValue);
+      return statement;
+    }
+    case NODE_RETURN: {
+      Return* ret = (Return*)statement;
+      if (ret->ReturnValue) ret->ReturnValue = FoldExpression(ret->ReturnValue);
+      return statement;
+    }
+    case NODE_IF: {
+      If* if_statement          = (If*)statement;
+      if_statement->IfCondition = FoldExpression(if_statement->IfCondition);
+      FoldBlock(if_statement->IfThenBlock);
+      if (if_statement->IfElseBlock) FoldBlock(if_statement->IfElseBlock);
+      return statement;
+    }
+    case NODE_WHILE: {
+      While* while_loop          = (While*)statement;
+      while_loop->WhileCondition = FoldExpression(while_loop->WhileCondition);
+      FoldBlock(while_loop->WhileBody);
+      return statement;
+    }
+    case NODE_VAR:
+    case NODE_BREAK:
+    case NODE_CONTINUE: return statement;
+  }
+  return FoldExpression(statement);
+}
+
+static void FoldBlock(Block* block) {
+  Cons* statements = block->BlockStatements;
+  while (statements) {
+    statements->Value = FoldStatement(statements->Value);
+    statements        = statements->Tail;
+  }
+}
+
+static void FoldFn(Fn* fn) {
+  TableClear(&LocalNames);
+
+  Cons* param = fn->FnParamNames;
+  while (param) {
+    TablePut(&LocalNames, param->Value, param);
+    param = param->Tail;
+  }
+
+  Cons* statement = fn->FnBlock->BlockStatements;
+  while (statement) {
+    Node* node = statement->Value;
+    if (node->NodeType == NODE_VAR) TablePut(&LocalNames, ((Var*)node)->VarName, node);
+    statement = statement->Tail;
+  }
+
+  FoldBlock(fn->FnBlock);
+}
+
+// Picks up any consts declared since the last call
+static void UpdateConstValues() {
+  Cons* constant = LastConst ? LastConst->Tail : Consts.ListHead;
+  while (constant) {
+    TablePut(&ConstValues, ((Const*)constant->Value)->ConstName, constant->Value);
+    LastConst = constant;
+    constant  = constant->Tail;
+  }
+}
+
+// Folds one function with the consts declared so far, for -stream
+void FoldFunction(Fn* fn) {
+  UpdateConstValues();
+  FoldFn(fn);
+}
+
+void FoldConstants() {
+  UpdateConstValues();
+
+  Cons* fn = Functions.ListHead;
+  while (fn) {
+    FoldFn(fn->Value);
+    fn = fn->Tail;
+  }
+}
@@ -0,0 +1,102 @@
+#include "IR.h"
+
+/* clang-format off */
+static const char* IrOpNames[IR_COUNT] = {
+  "nop", "copy", "+", "-", "&", "|", "*", "/", "%", "<<", ">>", ">>>",
+  "<", "<=", ">", ">=", "==", "!=",
+  "load", "load8", "store", "store8",
+  "call", "label", "jmp", "jz", "jnz",
+  "jlt", "jle", "jgt", "jge", "jeq", "jne",
+  "ret", "comment",
+};
+/* clang-format on */
+
+static void PrintOperand(Operand* operand) {
+  switch (operand->OperandKind) {
+    case IRO_TEMP: printf("t%ld", operand->OperandValue); return;
+    case IRO_CONST: printf("%ld", operand->OperandValue); return;
+    case IRO_STRING: printf("\"%s\"", operand->OperandName); return;
+    case IRO_GLOBAL: printf("&%s", operand->OperandName); return;
+    case IRO_SLOT: printf("&slot%ld", operand->OperandValue); return;
+  }
+}
+
+static void PrintIr(Ir* ir) {
+  switch (ir->IrOp) {
+    case IR_COMMENT: return;
+    case IR_LABEL: printf("L%ld:\n", ir->IrLabel); return;
+  }
+
+  printf("    ");
+  if (ir->IrDst >= 0) printf("t%ld = ", ir->IrDst);
+
+  switch (ir->IrOp) {
+    case IR_COPY: PrintOperand(&ir->IrA); break;
+    case IR_LOAD:
+    case IR_LOAD8:
+    case IR_RET: {
+      printf("%s", IrOpNames[ir->IrOp]);
+      if (ir->IrA.OperandKind != IRO_NONE) printf(" ");
+      PrintOperand(&ir->IrA);
+      break;
+    }
+    case IR_STORE:
+    case IR_STORE8: {
+      printf("%s ", IrOpNames[ir->IrOp]);
+      PrintOperand(&ir->IrA);
+      printf(", ");
+      PrintOperand(&ir->IrB);
+      break;
+    }
+    case IR_CALL: {
+      printf("call %s(", ir->IrName);
+      for (NUM i = 0; i < ir->IrArgCount; i++) {
+	if (i) printf(", ");
+	PrintOperand(&ir->IrArgs[i]);
+      }
+      printf(")");
+      break;
+    }
+    case IR_JMP: printf("jmp L%ld", ir->IrLabel); break;
+    case IR_JZ:
+    case IR_JNZ: {
+      printf("%s ", IrOpNames[ir->IrOp]);
+      PrintOperand(&ir->IrA);
+      printf(", L%ld", ir->IrLabel);
+      break;
+    }
+    case IR_JLT:
+    case IR_JLE:
+    case IR_JGT:
+    case IR_JGE:
+    case IR_JEQ:
+    case IR_JNE: {
+      printf("%s ", IrOpNames[ir->IrOp]);
+      PrintOperand(&ir->IrA);
+      printf(", ");
+      PrintOperand(&ir->IrB);
+      printf(", L%ld", ir->IrLabel);
+      break;
+    }
+    default: {
+      PrintOperand(&ir->IrA);
+      printf(" %s ", IrOpNames[ir->IrOp]);
+      PrintOperand(&ir->IrB);
+      break;
+    }
+  }
+  printf("\n");
+}
+
+void PrintIrFn(IrFn* fn) {
+  printf("fn %s(", fn->IrFnName);
+  for (NUM i = 0; i < fn->IrFnParamCount; i++) {
+    if (i) printf(", ");
+    printf("t%ld", i);
+  }
+  printf(") temps %ld slots %ld\n", fn->IrFnTempCount, fn->IrFnSlotCount);
+
+  for (NUM i = 0; i < fn->IrFnCodeCount; i++)
+    PrintIr(&fn->IrFnCode[i]);
+  printf("\n");
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include "Common.h"
+#include "Node.h"
+
+// Linear three-address code built from the AST by LowerFn (Lower.c).
+// Every IrFn has its own set of temporaries; params are temps 0 to argc - 1.
+
+enum IrOpEnum {
+  IR_NOP = 0,
+  IR_COPY,    // IrDst = IrA
+  IR_ADD,     // IrDst = IrA + IrB
+  IR_SUB,
+  IR_AND,
+  IR_OR,
+  IR_MUL,
+  IR_DIV,     // signed, rounds towards 0
+  IR_MOD,     // signed, has the sign of IrA
+  IR_SHL,     // IrDst = IrA << IrB, the count is taken mod 64
+  IR_SAR,     // arithmetic >>
+  IR_SHR,     // logical >>
+  IR_LT,      // IrDst = IrA < IrB ? 1 : 0
+  IR_LE,
+  IR_GT,
+  IR_GE,
+  IR_EQ,
+  IR_NE,
+  IR_LOAD,    // IrDst = 64 bits at address IrA
+  IR_LOAD8,   // IrDst = 8 bits at address IrA, zero extended
+  IR_STORE,   // 64 bits at address IrA = IrB
+  IR_STORE8,  // 8 bits at address IrA = IrB
+  IR_CALL,    // IrDst = IrName(IrArgs...)
+  IR_LABEL,   // IrLabel:
+  IR_JMP,     // goto IrLabel
+  IR_JZ,      // if IrA == 0 goto IrLabel
+  IR_JNZ,     // if IrA != 0 goto IrLabel
+  IR_JLT,     // if IrA < IrB goto IrLabel
+  IR_JLE,
+  IR_JGT,
+  IR_JGE,
+  IR_JEQ,
+  IR_JNE,
+  IR_RET,     // return IrA, if it's not IRO_NONE
+  IR_COMMENT, // source expression IrNode, for the asm listing
+
+  IR_COUNT,
+};
+typedef NUM IrOp;
+
+enum OperandKindEnum {
+  IRO_NONE = 0,
+  IRO_TEMP = 1,   // temporary OperandValue
+  IRO_CONST = 2,  // the number OperandValue
+  IRO_STRING = 3, // address of string literal OperandValue
+  IRO_GLOBAL = 4, // address of the static or extern OperandName
+  IRO_SLOT = 5,   // address of frame slot OperandValue, for variables whose address is taken
+};
+typedef NUM OperandKind;
+
+typedef struct Operand {
+  OperandKind OperandKind;
+  NUM OperandValue;
+  const char* OperandName;
+} Operand;
+
+typedef struct Ir {
+  IrOp IrOp;
+  NUM IrDst; // temporary, -1 if there is none
+  Operand IrA;
+  Operand IrB;
+  NUM IrLabel;
+  const char* IrName; // IR_CALL
+  Operand* IrArgs;    // IR_CALL
+  NUM IrArgCount;     // IR_CALL
+  Node* IrNode;       // IR_COMMENT
+} Ir;
+
+typedef struct IrFn {
+  const char* IrFnName;
+  NUM IrFnParamCount;
+  Ir* IrFnCode;
+  NUM IrFnCodeCount;
+  NUM IrFnTempCount;
+  BOOL* IrFnTempIsVariable; // temps that hold a k variable rather than one intermediate value
+  NUM IrFnSlotCount;
+} IrFn;
+
+IrFn* LowerFn(Fn* fn);
+
+// Indexes Functions for InlineCalls, before any function is generated
+void IndexInlineCallees();
+// fn with the calls to small functions and functions marked inline replaced by their bodies
+IrFn* InlineCalls(IrFn* fn);
+
+// Brings the consts, statics and externs LowerFn knows about up to date with the program.
+// LowerFn does it too, but lowering in parallel needs them to be up to date beforehand.
+void UpdateGlobalSymbols();
+BOOL CanLowerFn(Fn* fn);
+void PrintIrFn(IrFn* fn);
+BOOL IsExternName(const char* name);
+
+// Lowers every function and runs fn_name with no arguments, returning its result
+NUM InterpretProgram(const char* fn_name);
@@ -0,0 +1,207 @@
+#include "IR.h"
+#include "ProgramData.h"
+#include "Table.h"
+#include "Arena.h"
+
+// Inlines calls to small functions into the IR of their callers. Callees are lowered on
+// their own and copied in with their temps, slots and labels moved past the caller's,
+// params become copies of the arguments, and returns a copy to the call's result and a
+// jump past the body. Only one level deep: calls in an inlined body stay calls.
+// A call whose result is returned right away keeps the callee's returns as they are,
+// so that the callee's tail calls stay tail calls.
+
+// Functions with at most this many instructions are inlined, functions marked inline
+// whatever their size
+static const NUM INLINE_MAX_SIZE = 16;
+
+// Functions by name, filled in by IndexInlineCallees and only read after that
+static Table FunctionsByName;
+
+// Callees lowered by this thread so far, functions are generated in parallel with -j
+static __thread Table LoweredCallees;
+
+void IndexInlineCallees() {
+  Cons* fn = Functions.ListHead;
+  while (fn) {
+    TablePut(&FunctionsByName, ((Fn*)fn->Value)->FnName, fn->Value);
+    fn = fn->Tail;
+  }
+}
+
+static BOOL IsLabelOp(IrOp op) {
+  return op == IR_LABEL || (op >= IR_JMP && op <= IR_JNE);
+}
+
+static NUM CountLabels(IrFn* fn) {
+  NUM count = 0;
+  for (NUM i = 0; i < fn->IrFnCodeCount; i++) {
+    Ir* ir = &fn->IrFnCode[i];
+    if (IsLabelOp(ir->IrOp) && ir->IrLabel >= count) count = ir->IrLabel + 1;
+  }
+  return count;
+}
+
+// Instructions that end up as code, the trailing return of every function doesn't count
+static NUM InlineSize(IrFn* fn) {
+  NUM size = 0;
+  for (NUM i = 0; i < fn->IrFnCodeCount - 1; i++) {
+    IrOp op = fn->IrFnCode[i].IrOp;
+    if (op != IR_COMMENT && op != IR_LABEL) size++;
+  }
+  return size;
+}
+
+// The callee to inline at call, or NULL if it stays a call
+static IrFn* GetInlineCallee(IrFn* caller, Ir* call) {
+  Fn* fn = TableGet(&FunctionsByName, call->IrName);
+  if (!fn || fn->FnName == caller->IrFnName) return NULL;
+
+  IrFn* callee = TableGet(&LoweredCallees, fn->FnName);
+  if (!callee) {
+    callee = LowerFn(fn);
+    TablePut(&LoweredCallees, fn->FnName, callee);
+  }
+
+  if (callee->IrFnParamCount != call->IrArgCount) return NULL;
+  if (!fn->FnInline && InlineSize(callee) > INLINE_MAX_SIZE) return NULL;
+  return callee;
+}
+
+typedef struct InlineBase {
+  NUM BaseTemp;
+  NUM BaseSlot;
+  NUM BaseLabel;
+} InlineBase;
+
+static Operand Rebase(Operand operand, InlineBase* base) {
+  if (operand.OperandKind == IRO_TEMP) operand.OperandValue += base->BaseTemp;
+  if (operand.OperandKind == IRO_SLOT) operand.OperandValue += base->BaseSlot;
+  return operand;
+}
+
+// The index of the return of call's result if it comes right after call, otherwise -1
+static NUM GetTailReturn(IrFn* fn, NUM index) {
+  Ir* call = &fn->IrFnCode[index];
+  for (NUM i = index + 1; i < fn->IrFnCodeCount; i++) {
+    Ir* ir = &fn->IrFnCode[i];
+    if (ir->IrOp == IR_COMMENT) continue;
+    BOOL returns_call =
+        ir->IrOp == IR_RET && ir->IrA.OperandKind == IRO_TEMP && ir->IrA.OperandValue == call->IrDst;
+    return returns_call ? i : -1;
+  }
+  return -1;
+}
+
+// Copies callee into out in place of call, returns the number of instructions written
+static NUM ExpandCall(Ir* call, IrFn* callee, BOOL is_tail, InlineBase* base, Ir* out) {
+  NUM count     = 0;
+  NUM end_label = base->BaseLabel + CountLabels(callee);
+
+  for (NUM i = 0; i < callee->IrFnParamCount; i++) {
+    Ir* copy = &out[count++];
+    memset(copy, 0, sizeof(Ir));
+    copy->IrOp  = IR_COPY;
+    copy->IrDst = base->BaseTemp + i;
+    copy->IrA   = call->IrArgs[i];
+  }
+
+  for (NUM i = 0; i < callee->IrFnCodeCount; i++) {
+    Ir ir = callee->IrFnCode[i];
+
+    if (ir.IrOp == IR_RET && !is_tail) {
+      Ir* copy = &out[count++];
+      memset(copy, 0, sizeof(Ir));
+      copy->IrOp  = IR_COPY;
+      copy->IrDst = call->IrDst;
+      copy->IrA   = ir.IrA.OperandKind == IRO_NONE ? (Operand){ IRO_CONST, 0 } : Rebase(ir.IrA, base);
+
+      if (i == callee->IrFnCodeCount - 1) continue;
+      Ir* jump = &out[count++];
+      memset(jump, 0, sizeof(Ir));
+      jump->IrOp    = IR_JMP;
+      jump->IrDst   = -1;
+      jump->IrLabel = end_label;
+      continue;
+    }
+
+    if (ir.IrDst >= 0) ir.IrDst += base->BaseTemp;
+    if (IsLabelOp(ir.IrOp)) ir.IrLabel += base->BaseLabel;
+    ir.IrA = Rebase(ir.IrA, base);
+    ir.IrB = Rebase(ir.IrB, base);
+
+    if (ir.IrOp == IR_CALL) {
+      Operand* args = ArenaAlloc(ir.IrArgCount * sizeof(Operand));
+      for (NUM j = 0; j < ir.IrArgCount; j++)
+        args[j] = Rebase(ir.IrArgs[j], base);
+      ir.IrArgs = args;
+    }
+
+    out[count++] = ir;
+  }
+
+  if (!is_tail) {
+    Ir* label = &out[count++];
+    memset(label, 0, sizeof(Ir));
+    label->IrOp    = IR_LABEL;
+    label->IrDst   = -1;
+    label->IrLabel = end_label;
+  }
+
+  base->BaseTemp += callee->IrFnTempCount;
+  base->BaseSlot += callee->IrFnSlotCount;
+  base->BaseLabel = end_label + 1;
+  return count;
+}
+
+IrFn* InlineCalls(IrFn* fn) {
+  IrFn** callees = ArenaAlloc(fn->IrFnCodeCount * sizeof(IrFn*));
+  NUM code_count = fn->IrFnCodeCount;
+  NUM temp_count = fn->IrFnTempCount;
+  NUM slot_count = fn->IrFnSlotCount;
+  BOOL inlined   = FALSE;
+
+  // Params, body (a return can become a copy and a jump) and the end label
+  for (NUM i = 0; i < fn->IrFnCodeCount; i++) {
+    Ir* ir     = &fn->IrFnCode[i];
+    callees[i] = ir->IrOp == IR_CALL ? GetInlineCallee(fn, ir) : NULL;
+    if (!callees[i]) continue;
+
+    code_count += callees[i]->IrFnParamCount + 2 * callees[i]->IrFnCodeCount;
+    temp_count += callees[i]->IrFnTempCount;
+    slot_count += callees[i]->IrFnSlotCount;
+    inlined = TRUE;
+  }
+
+  if (!inlined) return fn;
+
+  IrFn* result               = ArenaAlloc(sizeof(IrFn));
+  *result                    = *fn;
+  result->IrFnCode           = ArenaAlloc(code_count * sizeof(Ir));
+  result->IrFnTempIsVariable = ArenaAlloc(temp_count * sizeof(BOOL));
+  result->IrFnTempCount      = temp_count;
+  result->IrFnSlotCount      = slot_count;
+  memcpy(result->IrFnTempIsVariable, fn->IrFnTempIsVariable, fn->IrFnTempCount * sizeof(BOOL));
+
+  InlineBase base = { fn->IrFnTempCount, fn->IrFnSlotCount, CountLabels(fn) };
+  NUM count       = 0;
+  for (NUM i = 0; i < fn->IrFnCodeCount; i++) {
+    IrFn* callee = callees[i];
+    if (!callee) {
+      result->IrFnCode[count++] = fn->IrFnCode[i];
+      continue;
+    }
+
+    memcpy(result->IrFnTempIsVariable + base.BaseTemp, callee->IrFnTempIsVariable,
+           callee->IrFnTempCount * sizeof(BOOL));
+    // Assigned by every return in the body, like the result of && and ||
+    result->IrFnTempIsVariable[fn->IrFnCode[i].IrDst] = TRUE;
+
+    // The caller's return is replaced by the callee's
+    NUM tail_return = GetTailReturn(fn, i);
+    count += ExpandCall(&fn->IrFnCode[i], callee, tail_return >= 0, &base, result->IrFnCode + count);
+    if (tail_return >= 0) i = tail_return;
+  }
+
+  result->IrFnCodeCount = count;
+  return result;
+}
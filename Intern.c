@@ -0,0 +1,128 @@
+#include <pthread.h>
+#include <stddef.h>
+
+#include "Intern.h"
+#include "Arena.h"
+
+// Every distinct name is stored once, so names can be compared by pointer.
+// Atoms handed out are pointers to AtomStr, the header sits right before it.
+typedef struct Atom {
+  TokenType AtomTokenType; // keyword token type, TOK_ID for plain identifiers
+  Intrinsic AtomIntrinsic; // what calls to the name do, INTRINSIC_NONE for plain functions
+  NUM AtomHash;
+  NUM AtomLength;
+  char AtomStr[];
+} Atom;
+
+typedef struct Keyword {
+  const char* KeywordName;
+  TokenType KeywordTokenType;
+} Keyword;
+
+static Keyword Keywords[] = {
+  { "if", TOK_IF },         { "else", TOK_ELSE },       { "while", TOK_WHILE },   { "fn", TOK_FN },
+  { "return", TOK_RETURN }, { "set", TOK_SET },         { "set8", TOK_SET8 },     { "var", TOK_VAR },
+  { "extern", TOK_EXTERN }, { "const", TOK_CONST },     { "static", TOK_STATIC }, { "break", TOK_BREAK },
+  { "continue", TOK_CONTINUE }, { "inline", TOK_INLINE },
+};
+
+typedef struct IntrinsicName {
+  const char* IntrinsicName;
+  Intrinsic IntrinsicId;
+} IntrinsicName;
+
+static IntrinsicName IntrinsicNames[] = {
+  { "get", INTRINSIC_GET }, { "get8", INTRINSIC_GET8 }, { "addr", INTRINSIC_ADDR },
+};
+
+// The -j workers intern concurrently, the table is only read or changed under AtomsLock.
+// Atom headers don't change after InitAtoms, so they can be read without it.
+static pthread_mutex_t AtomsLock = PTHREAD_MUTEX_INITIALIZER;
+static Atom** Atoms;
+static NUM AtomsCapacity;
+static NUM AtomsCount;
+
+static NUM HashSlice(const char* str, NUM length) {
+  uint64_t hash = 14695981039346656037u;
+  for (NUM i = 0; i < length; i++) {
+    hash ^= (unsigned char)str[i];
+    hash *= 1099511628211u;
+  }
+  return (NUM)(hash >> 1);
+}
+
+static Atom** FindSlot(Atom** atoms, NUM capacity, const char* str, NUM length, NUM hash) {
+  NUM mask  = capacity - 1;
+  NUM index = hash & mask;
+
+  while (1) {
+    Atom* atom = atoms[index];
+    if (!atom) return &atoms[index];
+    if (atom->AtomHash == hash && atom->AtomLength == length && memcmp(atom->AtomStr, str, length) == 0)
+      return &atoms[index];
+    index = (index + 1) & mask;
+  }
+}
+
+static void Grow() {
+  NUM capacity = AtomsCapacity ? AtomsCapacity * 2 : 1024;
+  Atom** atoms = calloc(capacity, sizeof(Atom*));
+
+  for (NUM i = 0; i < AtomsCapacity; i++) {
+    Atom* atom = Atoms[i];
+    if (atom) *FindSlot(atoms, capacity, atom->AtomStr, atom->AtomLength, atom->AtomHash) = atom;
+  }
+
+  free(Atoms);
+  Atoms         = atoms;
+  AtomsCapacity = capacity;
+}
+
+const char* Intern(const char* str, NUM length) {
+  NUM hash = HashSlice(str, length);
+
+  pthread_mutex_lock(&AtomsLock);
+  if ((AtomsCount + 1) * 2 > AtomsCapacity) Grow();
+
+  Atom** slot = FindSlot(Atoms, AtomsCapacity, str, length, hash);
+  if (*slot) {
+    pthread_mutex_unlock(&AtomsLock);
+    return (*slot)->AtomStr;
+  }
+
+  BOOL was_permanent  = SetArenaPermanent(TRUE);
+  Atom* atom          = ArenaAlloc(sizeof(Atom) + length + 1);
+  SetArenaPermanent(was_permanent);
+
+  atom->AtomTokenType = TOK_ID;
+  atom->AtomIntrinsic = INTRINSIC_NONE;
+  atom->AtomHash      = hash;
+  atom->AtomLength    = length;
+  memcpy(atom->AtomStr, str, length);
+  atom->AtomStr[length] = 0;
+
+  *slot = atom;
+  AtomsCount++;
+  pthread_mutex_unlock(&AtomsLock);
+  return atom->AtomStr;
+}
+
+TokenType GetAtomTokenType(const char* atom) {
+  return ((Atom*)(atom - offsetof(Atom, AtomStr)))->AtomTokenType;
+}
+
+Intrinsic GetAtomIntrinsic(const char* atom) {
+  return ((Atom*)(atom - offsetof(Atom, AtomStr)))->AtomIntrinsic;
+}
+
+void InitAtoms() {
+  for (NUM i = 0; i < sizeof(Keywords) / sizeof(Keywords[0]); i++) {
+    const char* name = Intern(Keywords[i].KeywordName, strlen(Keywords[i].KeywordName));
+    ((Atom*)(name - offsetof(Atom, AtomStr)))->AtomTokenType = Keywords[i].KeywordTokenType;
+  }
+
+  for (NUM i = 0; i < sizeof(IntrinsicNames) / sizeof(IntrinsicNames[0]); i++) {
+    const char* name = Intern(IntrinsicNames[i].IntrinsicName, strlen(IntrinsicNames[i].IntrinsicName));
+    ((Atom*)(name - offsetof(Atom, AtomStr)))->AtomIntrinsic = IntrinsicNames[i].IntrinsicId;
+  }
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "Common.h"
+#include "Token.h"
+#include "Node.h"
+
+void InitAtoms();
+const char* Intern(const char* str, NUM length);
+TokenType GetAtomTokenType(const char* atom);
+Intrinsic GetAtomIntrinsic(const char* atom);
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+
+#include "IR.h"
+#include "ProgramData.h"
+#include "Table.h"
+#include "Intern.h"
+#include "Arena.h"
+
+// Runs IR directly, for testing the lowering without an assembler.
+// Memory is real memory, so get/set work on real pointers, and externs
+// are looked up in the running process with dlsym.
+
+typedef struct InterpFn {
+  IrFn* InterpIr;
+  NUM InterpFirstLabel;
+  NUM* InterpLabelTargets; // instruction index of label InterpFirstLabel + i
+} InterpFn;
+
+typedef NUM (*ExternFn)(NUM, ...);
+
+static Table InterpFunctions;
+static Table StaticStorage;
+
+static InterpFn* MakeInterpFn(IrFn* ir_fn) {
+  InterpFn* fn = ArenaAlloc(sizeof(InterpFn));
+  fn->InterpIr = ir_fn;
+
+  NUM first_label = -1;
+  NUM last_label  = -1;
+  for (NUM i = 0; i < ir_fn->IrFnCodeCount; i++) {
+    Ir* ir = &ir_fn->IrFnCode[i];
+    if (ir->IrOp != IR_LABEL) continue;
+    if (first_label < 0 || ir->IrLabel < first_label) first_label = ir->IrLabel;
+    if (ir->IrLabel > last_label) last_label = ir->IrLabel;
+  }
+
+  fn->InterpFirstLabel   = first_label;
+  fn->InterpLabelTargets = ArenaAlloc((last_label - first_label + 1) * sizeof(NUM));
+  for (NUM i = 0; i < ir_fn->IrFnCodeCount; i++) {
+    Ir* ir = &ir_fn->IrFnCode[i];
+    if (ir->IrOp == IR_LABEL) fn->InterpLabelTargets[ir->IrLabel - first_label] = i;
+  }
+  return fn;
+}
+
+static void* LookupExtern(const char* name) {
+  void* address = dlsym(RTLD_DEFAULT, name);
+  if (!address) {
+    fprintf(stderr, "Unresolved extern %s\n", name);
+    exit(1);
+  }
+  return address;
+}
+
+static NUM GetOperandValue(Operand* operand, NUM* temps, NUM* slots) {
+  switch (operand->OperandKind) {
+    case IRO_TEMP: return temps[operand->OperandValue];
+    case IRO_CONST: return operand->OperandValue;
+    case IRO_STRING: return (NUM)operand->OperandName;
+    case IRO_SLOT: return (NUM)&slots[operand->OperandValue];
+    case IRO_GLOBAL: {
+      NUM* storage = TableGet(&StaticStorage, operand->OperandName);
+      if (storage) return (NUM)storage;
+      return (NUM)LookupExtern(operand->OperandName);
+    }
+  }
+  return 0;
+}
+
+static BOOL IsBranchTaken(IrOp op, NUM a, NUM b) {
+  switch (op) {
+    case IR_JZ: return a == 0;
+    case IR_JNZ: return a != 0;
+    case IR_JLT: return a < b;
+    case IR_JLE: return a <= b;
+    case IR_JGT: return a > b;
+    case IR_JGE: return a >= b;
+    case IR_JEQ: return a == b;
+    case IR_JNE: return a != b;
+  }
+  return FALSE;
+}
+
+static NUM Interpret(InterpFn* fn, NUM* args, NUM argc) {
+  IrFn* ir_fn = fn->InterpIr;
+
+  NUM temps[ir_fn->IrFnTempCount + 1];
+  NUM slots[ir_fn->IrFnSlotCount + 1];
+  memset(temps, 0, sizeof(temps));
+  memset(slots, 0, sizeof(slots));
+
+  for (NUM i = 0; i < argc && i < ir_fn->IrFnParamCount; i++)
+    temps[i] = args[i];
+
+  NUM pc = 0;
+  while (pc < ir_fn->IrFnCodeCount) {
+    Ir* ir = &ir_fn->IrFnCode[pc++];
+    NUM a  = GetOperandValue(&ir->IrA, temps, slots);
+    NUM b  = GetOperandValue(&ir->IrB, temps, slots);
+
+    switch (ir->IrOp) {
+      case IR_COPY: temps[ir->IrDst] = a; break;
+      case IR_ADD: temps[ir->IrDst] = a + b; break;
+      case IR_SUB: temps[ir->IrDst] = a - b; break;
+      case IR_AND: temps[ir->IrDst] = a & b; break;
+      case IR_OR: temps[ir->IrDst] = a | b; break;
+      case IR_MUL: temps[ir->IrDst] = a * b; break;
+      case IR_DIV: temps[ir->IrDst] = a / b; break;
+      case IR_MOD: temps[ir->IrDst] = a % b; break;
+      case IR_SHL: temps[ir->IrDst] = (NUM)((uint64_t)a << (b & 63)); break;
+      case IR_SAR: temps[ir->IrDst] = a >> (b & 63); break;
+      case IR_SHR: temps[ir->IrDst] = (NUM)((uint64_t)a >> (b & 63)); break;
+      case IR_LT: temps[ir->IrDst] = a < b; break;
+      case IR_LE: temps[ir->IrDst] = a <= b; break;
+      case IR_GT: temps[ir->IrDst] = a > b; break;
+      case IR_GE: temps[ir->IrDst] = a >= b; break;
+      case IR_EQ: temps[ir->IrDst] = a == b; break;
+      case IR_NE: temps[ir->IrDst] = a != b; break;
+      case IR_LOAD: temps[ir->IrDst] = *(NUM*)a; break;
+      case IR_LOAD8: temps[ir->IrDst] = *(uint8_t*)a; break;
+      case IR_STORE: *(NUM*)a = b; break;
+      case IR_STORE8: *(uint8_t*)a = b; break;
+      case IR_JMP: pc = fn->InterpLabelTargets[ir->IrLabel - fn->InterpFirstLabel]; break;
+      case IR_JZ:
+      case IR_JNZ:
+      case IR_JLT:
+      case IR_JLE:
+      case IR_JGT:
+      case IR_JGE:
+      case IR_JEQ:
+      case IR_JNE: {
+	if (IsBranchTaken(ir->IrOp, a, b)) pc = fn->InterpLabelTargets[ir->IrLabel - fn->InterpFirstLabel];
+	break;
+      }
+      case IR_RET: return a;
+      case IR_CALL: {
+	NUM call_args[6] = { 0 };
+	for (NUM i = 0; i < ir->IrArgCount && i < 6; i++)
+	  call_args[i] = GetOperandValue(&ir->IrArgs[i], temps, slots);
+
+	InterpFn* callee = TableGet(&InterpFunctions, ir->IrName);
+	if (callee) {
+	  temps[ir->IrDst] = Interpret(callee, call_args, ir->IrArgCount);
+	} else {
+	  ExternFn extern_fn = (ExternFn)LookupExtern(ir->IrName);
+	  temps[ir->IrDst]   = extern_fn(call_args[0], call_args[1], call_args[2], call_args[3], call_args[4],
+                                         call_args[5]);
+	}
+	break;
+      }
+    }
+  }
+  return 0;
+}
+
+NUM InterpretProgram(const char* fn_name) {
+  Cons* fn = Functions.ListHead;
+  while (fn) {
+    Fn* ast_fn = fn->Value;
+    TablePut(&InterpFunctions, ast_fn->FnName, MakeInterpFn(LowerFn(ast_fn)));
+    fn = fn->Tail;
+  }
+
+  Cons* statics = StaticVariables.ListHead;
+  while (statics) {
+    TablePut(&StaticStorage, ((Var*)statics->Value)->VarName, calloc(1, sizeof(NUM)));
+    statics = statics->Tail;
+  }
+
+  InterpFn* entry = TableGet(&InterpFunctions, Intern(fn_name, strlen(fn_name)));
+  if (!entry) {
+    fprintf(stderr, "Unknown function %s\n", fn_name);
+    exit(1);
+  }
+  return Interpret(entry, NULL, 0);
+}
@@ -0,0 +1,823 @@
+#include "IR.h"
+#include "ProgramData.h"
+#include "Table.h"
+#include "Arena.h"
+
+// The load done by each get intrinsic
+/* clang-format off */
+static IrOp IntrinsicLoads[INTRINSIC_COUNT] = {
+  [INTRINSIC_GET] = IR_LOAD, [INTRINSIC_GET8] = IR_LOAD8,
+};
+
+static IrOp BinaryOps[BINARY_COUNT] = {
+  [BINARY_ADD] = IR_ADD, [BINARY_SUB] = IR_SUB, [BINARY_MUL] = IR_MUL,
+  [BINARY_BAND] = IR_AND, [BINARY_BOR] = IR_OR, [BINARY_DIV] = IR_DIV, [BINARY_MOD] = IR_MOD,
+  [BINARY_SHL] = IR_SHL, [BINARY_SAR] = IR_SAR, [BINARY_SHR] = IR_SHR,
+  [BINARY_LT] = IR_LT, [BINARY_LE] = IR_LE, [BINARY_GT] = IR_GT,
+  [BINARY_GE] = IR_GE, [BINARY_EQ] = IR_EQ, [BINARY_NE] = IR_NE,
+};
+
+// Branch taken when a comparison holds, and when it doesn't
+static IrOp BinaryJumps[BINARY_COUNT] = {
+  [BINARY_GT] = IR_JGT, [BINARY_LT] = IR_JLT, [BINARY_GE] = IR_JGE,
+  [BINARY_LE] = IR_JLE, [BINARY_EQ] = IR_JEQ, [BINARY_NE] = IR_JNE,
+};
+
+static IrOp BinaryInverseJumps[BINARY_COUNT] = {
+  [BINARY_GT] = IR_JLE, [BINARY_LT] = IR_JGE, [BINARY_GE] = IR_JLT,
+  [BINARY_LE] = IR_JGT, [BINARY_EQ] = IR_JNE, [BINARY_NE] = IR_JEQ,
+};
+/* clang-format on */
+
+enum SymbolKindEnum {
+  SYM_NONE = 0,
+  SYM_CONST = 1,
+  SYM_TEMP = 2,
+  SYM_SLOT = 3,
+  SYM_STATIC = 4,
+  SYM_EXTERN = 5,
+};
+typedef NUM SymbolKind;
+
+typedef struct Symbol {
+  SymbolKind SymbolKind;
+  NUM SymbolValue; // the constant, temp or slot
+} Symbol;
+
+// Consts, statics and externs, brought up to date by every LowerFn.
+// The lists only grow, the Last* cells are the last ones added.
+static Table GlobalSymbols;
+static Cons* LastConst;
+static Cons* LastStatic;
+static Cons* LastExtern;
+
+// The rest is per function, and per thread since functions are lowered in parallel with -j
+
+// Params and locals of the function being lowered
+static __thread Table FunctionSymbols;
+static __thread Symbol* FunctionSymbolStorage;
+static __thread NUM FunctionSymbolCapacity;
+
+// Names of variables that have to stay in memory
+static __thread Table AddressTaken;
+
+static __thread Ir* Code;
+static __thread NUM CodeCount;
+static __thread NUM CodeCapacity;
+
+static __thread BOOL* TempIsVariable;
+static __thread NUM TempCount;
+static __thread NUM TempCapacity;
+static __thread NUM SlotCount;
+
+// Labels are local to their function
+static __thread NUM NextLabel;
+static __thread NUM CurrentBreakLabel;
+static __thread NUM CurrentContinueLabel;
+
+// Self-recursive tail calls jump back to EntryLabel, which is placed at EntryPosition
+// once one does. Returns of the form x + Self(...) add x to Accumulator and loop too,
+// then every other return adds Accumulator to its value. Both are -1 when unused.
+static __thread Fn* CurrentFn;
+static __thread NUM EntryLabel;
+static __thread NUM EntryPosition;
+static __thread NUM Accumulator;
+
+static Operand NoOperand = { IRO_NONE };
+
+static Operand LowerExpression(Node* expression);
+static void LowerBlock(Block* block);
+
+void UpdateGlobalSymbols() {
+  // Functions are released after codegen with -stream, global symbols aren't
+  BOOL was_permanent = SetArenaPermanent(TRUE);
+
+  Cons* constant_list = LastConst ? LastConst->Tail : Consts.ListHead;
+  while (constant_list) {
+    Const* constant     = constant_list->Value;
+    Symbol* symbol      = ArenaAlloc(sizeof(Symbol));
+    symbol->SymbolKind  = SYM_CONST;
+    symbol->SymbolValue = constant->ConstValue;
+    TablePut(&GlobalSymbols, constant->ConstName, symbol);
+    LastConst     = constant_list;
+    constant_list = constant_list->Tail;
+  }
+
+  Cons* statics = LastStatic ? LastStatic->Tail : StaticVariables.ListHead;
+  while (statics) {
+    Var* var           = statics->Value;
+    Symbol* symbol     = ArenaAlloc(sizeof(Symbol));
+    symbol->SymbolKind = SYM_STATIC;
+    TablePut(&GlobalSymbols, var->VarName, symbol);
+    LastStatic = statics;
+    statics    = statics->Tail;
+  }
+
+  Cons* extern_var = LastExtern ? LastExtern->Tail : Externs.ListHead;
+  while (extern_var) {
+    Symbol* symbol     = ArenaAlloc(sizeof(Symbol));
+    symbol->SymbolKind = SYM_EXTERN;
+    TablePut(&GlobalSymbols, extern_var->Value, symbol);
+    LastExtern = extern_var;
+    extern_var = extern_var->Tail;
+  }
+
+  SetArenaPermanent(was_permanent);
+}
+
+BOOL IsExternName(const char* name) {
+  Symbol* symbol = TableGet(&GlobalSymbols, name);
+  return symbol && symbol->SymbolKind == SYM_EXTERN;
+}
+
+static Symbol* LookupSymbol(const char* name) {
+  Symbol* symbol = TableGet(&FunctionSymbols, name);
+  if (symbol) return symbol;
+  return TableGet(&GlobalSymbols, name);
+}
+
+static NUM NewTemp(BOOL is_variable) {
+  if (TempCount == TempCapacity) {
+    TempCapacity   = TempCapacity ? TempCapacity * 2 : 256;
+    TempIsVariable = realloc(TempIsVariable, TempCapacity * sizeof(BOOL));
+  }
+  TempIsVariable[TempCount] = is_variable;
+  return TempCount++;
+}
+
+static Operand TempOperand(NUM temp) {
+  return (Operand){ IRO_TEMP, temp };
+}
+
+static Operand ConstOperand(NUM value) {
+  return (Operand){ IRO_CONST, value };
+}
+
+static Ir* AddIr(IrOp op) {
+  if (CodeCount == CodeCapacity) {
+    CodeCapacity = CodeCapacity ? CodeCapacity * 2 : 1024;
+    Code         = realloc(Code, CodeCapacity * sizeof(Ir));
+  }
+
+  Ir* ir = &Code[CodeCount++];
+  memset(ir, 0, sizeof(Ir));
+  ir->IrOp  = op;
+  ir->IrDst = -1;
+  return ir;
+}
+
+static Operand EmitValue(IrOp op, Operand a, Operand b) {
+  Ir* ir    = AddIr(op);
+  ir->IrDst = NewTemp(FALSE);
+  ir->IrA   = a;
+  ir->IrB   = b;
+  return TempOperand(ir->IrDst);
+}
+
+static void EmitStore(IrOp op, Operand address, Operand value) {
+  Ir* ir  = AddIr(op);
+  ir->IrA = address;
+  ir->IrB = value;
+}
+
+static void EmitJump(IrOp op, Operand condition, NUM label) {
+  Ir* ir      = AddIr(op);
+  ir->IrA     = condition;
+  ir->IrLabel = label;
+}
+
+static void PlaceLabel(NUM label) {
+  AddIr(IR_LABEL)->IrLabel = label;
+}
+
+static Operand GetVarAddress(const char* name) {
+  Symbol* symbol = LookupSymbol(name);
+
+  if (!symbol || symbol->SymbolKind == SYM_CONST) {
+    fprintf(stderr, "Invalid variable %s\n", name);
+    exit(1);
+  }
+
+  switch (symbol->SymbolKind) {
+    case SYM_SLOT: return (Operand){ IRO_SLOT, symbol->SymbolValue };
+    case SYM_STATIC:
+    case SYM_EXTERN: return (Operand){ IRO_GLOBAL, 0, name };
+  }
+
+  fprintf(stderr, "Cannot take the address of %s\n", name);
+  exit(1);
+}
+
+static Operand LowerReference(const char* name) {
+  Symbol* symbol = LookupSymbol(name);
+
+  if (symbol && symbol->SymbolKind == SYM_CONST) return ConstOperand(symbol->SymbolValue);
+  if (symbol && symbol->SymbolKind == SYM_TEMP) return TempOperand(symbol->SymbolValue);
+
+  return EmitValue(IR_LOAD, GetVarAddress(name), NoOperand);
+}
+
+static Operand LowerAddress(Node* node);
+static void LowerBranch(Node* condition, BOOL when_true, NUM label);
+
+static Operand LowerCall(Call* call) {
+  if (call->CallFunction->NodeType != NODE_REFERENCE) {
+    fprintf(stderr, "Invalid function call\n");
+    exit(1);
+  }
+
+  switch (call->CallIntrinsic) {
+    case INTRINSIC_GET:
+    case INTRINSIC_GET8: {
+      Operand address = LowerExpression(call->CallArguments->Value);
+      return EmitValue(IntrinsicLoads[call->CallIntrinsic], address, NoOperand);
+    }
+    case INTRINSIC_ADDR: return LowerAddress(call->CallArguments->Value);
+  }
+
+  NUM argc      = Length(call->CallArguments);
+  Operand* args = ArenaAlloc(argc * sizeof(Operand));
+
+  NUM argument_index = 0;
+  Cons* arg          = call->CallArguments;
+  while (arg) {
+    args[argument_index++] = LowerExpression(arg->Value);
+    arg = arg->Tail;
+  }
+
+  Ir* ir         = AddIr(IR_CALL);
+  ir->IrDst      = NewTemp(FALSE);
+  ir->IrName     = ((Reference*)call->CallFunction)->ReferenceName;
+  ir->IrArgs     = args;
+  ir->IrArgCount = argc;
+  return TempOperand(ir->IrDst);
+}
+
+static void EmitCopy(NUM temp, Operand value) {
+  Ir* ir    = AddIr(IR_COPY);
+  ir->IrA   = value;
+  ir->IrDst = temp;
+}
+
+static Operand LowerBinary(Binary* binary, BOOL is_lvalue) {
+  BinaryOperator op = binary->BinaryOperator;
+
+  // && and || only evaluate the right side when they have to
+  if (op == BINARY_AND || op == BINARY_OR) {
+    NUM result     = NewTemp(TRUE);
+    NUM done_label = NextLabel++;
+    EmitCopy(result, ConstOperand(0));
+    LowerBranch((Node*)binary, FALSE, done_label);
+    EmitCopy(result, ConstOperand(1));
+    PlaceLabel(done_label);
+    return TempOperand(result);
+  }
+
+  Operand lhs = LowerExpression(binary->BinaryLeft);
+  Operand rhs = LowerExpression(binary->BinaryRight);
+
+  if (op == BINARY_ARROW) {
+    Operand address = EmitValue(IR_ADD, lhs, rhs);
+    if (is_lvalue) return address;
+    return EmitValue(IR_LOAD, address, NoOperand);
+  }
+
+  return EmitValue(BinaryOps[op], lhs, rhs);
+}
+
+static Operand LowerUnary(Unary* unary) {
+  Operand operand = LowerExpression(unary->UnaryOperand);
+  if (unary->UnaryOperator == UNARY_NEG) return EmitValue(IR_SUB, ConstOperand(0), operand);
+  return EmitValue(IR_EQ, operand, ConstOperand(0));
+}
+
+static Operand LowerAddress(Node* node) {
+  if (node->NodeType == NODE_REFERENCE) return GetVarAddress(((Reference*)node)->ReferenceName);
+  if (node->NodeType == NODE_BINARY) return LowerBinary((Binary*)node, TRUE);
+  return LowerExpression(node);
+}
+
+static Operand LowerExpression(Node* expression) {
+  AddIr(IR_COMMENT)->IrNode = expression;
+
+  switch (expression->NodeType) {
+    case NODE_NUMBER: return ConstOperand(((Number*)expression)->NumberValue);
+    case NODE_STRING: {
+      String* str = (String*)expression;
+      return (Operand){ IRO_STRING, str->StringLabel, str->StringStr };
+    }
+    case NODE_REFERENCE: return LowerReference(((Reference*)expression)->ReferenceName);
+    case NODE_CALL: return LowerCall((Call*)expression);
+    case NODE_BINARY: return LowerBinary((Binary*)expression, FALSE);
+    case NODE_UNARY: return LowerUnary((Unary*)expression);
+  }
+
+  fprintf(stderr, "Expression Type Not implemented\n");
+  exit(1);
+}
+
+static BOOL HasCalls(Node* node) {
+  switch (node->NodeType) {
+    case NODE_BINARY: {
+      Binary* binary = (Binary*)node;
+      return HasCalls(binary->BinaryLeft) || HasCalls(binary->BinaryRight);
+    }
+    case NODE_UNARY: return HasCalls(((Unary*)node)->UnaryOperand);
+    case NODE_CALL: {
+      if (((Call*)node)->CallIntrinsic == INTRINSIC_NONE) return TRUE;
+
+      Cons* arg = ((Call*)node)->CallArguments;
+      while (arg) {
+	if (HasCalls(arg->Value)) return TRUE;
+	arg = arg->Tail;
+      }
+      return FALSE;
+    }
+  }
+  return FALSE;
+}
+
+// Comparisons, ! and && || are always 0 or 1, and so are & and | of conditions
+static BOOL IsCondition(Node* node) {
+  if (node->NodeType == NODE_UNARY) return ((Unary*)node)->UnaryOperator == UNARY_NOT;
+  if (node->NodeType != NODE_BINARY) return FALSE;
+
+  Binary* binary    = (Binary*)node;
+  BinaryOperator op = binary->BinaryOperator;
+  if (BinaryJumps[op] || op == BINARY_AND || op == BINARY_OR) return TRUE;
+  if (op != BINARY_BAND && op != BINARY_BOR) return FALSE;
+  return IsCondition(binary->BinaryLeft) && IsCondition(binary->BinaryRight);
+}
+
+// Jumps to label if the condition's truth is when_true, and falls through otherwise.
+// Comparisons become a compare-and-branch without a 0/1 value ever being computed,
+// && and || short-circuit, and so do & and | of conditions when the right side can
+// be skipped safely.
+static void LowerBranch(Node* condition, BOOL when_true, NUM label) {
+  AddIr(IR_COMMENT)->IrNode = condition;
+
+  if (condition->NodeType == NODE_NUMBER) {
+    if ((((Number*)condition)->NumberValue != 0) == when_true) EmitJump(IR_JMP, NoOperand, label);
+    return;
+  }
+
+  if (condition->NodeType == NODE_UNARY && ((Unary*)condition)->UnaryOperator == UNARY_NOT) {
+    LowerBranch(((Unary*)condition)->UnaryOperand, !when_true, label);
+    return;
+  }
+
+  Binary* binary    = condition->NodeType == NODE_BINARY ? (Binary*)condition : NULL;
+  BinaryOperator op = binary ? binary->BinaryOperator : BINARY_COUNT;
+
+  if (binary && BinaryJumps[op]) {
+    Operand lhs = LowerExpression(binary->BinaryLeft);
+    Operand rhs = LowerExpression(binary->BinaryRight);
+
+    Ir* ir      = AddIr(when_true ? BinaryJumps[op] : BinaryInverseJumps[op]);
+    ir->IrA     = lhs;
+    ir->IrB     = rhs;
+    ir->IrLabel = label;
+    return;
+  }
+
+  BOOL is_logical = op == BINARY_AND || op == BINARY_OR;
+  if (is_logical || (IsCondition(condition) && !HasCalls(binary->BinaryRight))) {
+    // a && b is false as soon as a is, a || b is true as soon as a is
+    BOOL short_circuit_on = op == BINARY_OR || op == BINARY_BOR;
+    if (short_circuit_on == when_true) {
+      LowerBranch(binary->BinaryLeft, when_true, label);
+      LowerBranch(binary->BinaryRight, when_true, label);
+    } else {
+      NUM skip_label = NextLabel++;
+      LowerBranch(binary->BinaryLeft, short_circuit_on, skip_label);
+      LowerBranch(binary->BinaryRight, when_true, label);
+      PlaceLabel(skip_label);
+    }
+    return;
+  }
+
+  Operand value = LowerExpression(condition);
+  EmitJump(when_true ? IR_JNZ : IR_JZ, value, label);
+}
+
+static void LowerSet(Set* set) {
+  // Variables that live in a temp are written directly
+  if (set->SetDestination->NodeType == NODE_REFERENCE) {
+    Symbol* symbol = LookupSymbol(((Reference*)set->SetDestination)->ReferenceName);
+    if (symbol && symbol->SymbolKind == SYM_TEMP) {
+      EmitCopy(symbol->SymbolValue, LowerExpression(set->SetValue));
+      return;
+    }
+  }
+
+  Operand address = LowerAddress(set->SetDestination);
+  Operand value   = LowerExpression(set->SetValue);
+  EmitStore(set->SetIsEightBit ? IR_STORE8 : IR_STORE, address, value);
+}
+
+// A call to the function being lowered that can become a jump back to its start.
+// Functions with slots keep their calls, a pointer to a slot could be an argument.
+static BOOL IsSelfCall(Node* node) {
+  if (!node || node->NodeType != NODE_CALL || SlotCount > 0) return FALSE;
+
+  Call* call = (Call*)node;
+  if (call->CallIntrinsic != INTRINSIC_NONE || call->CallFunction->NodeType != NODE_REFERENCE) return FALSE;
+
+  const char* name = ((Reference*)call->CallFunction)->ReferenceName;
+  return name == CurrentFn->FnName && !TableGet(&FunctionSymbols, name)
+      && Length(call->CallArguments) == Length(CurrentFn->FnParamNames);
+}
+
+// Whether node has the same value before and after a call, a number or a local.
+// Statics and externs can be changed by the call.
+static BOOL IsUnchangedByCall(Node* node) {
+  if (node->NodeType == NODE_NUMBER) return TRUE;
+  if (node->NodeType != NODE_REFERENCE) return FALSE;
+
+  Symbol* symbol = LookupSymbol(((Reference*)node)->ReferenceName);
+  return symbol && symbol->SymbolKind == SYM_TEMP;
+}
+
+// The self call in value if it's addend + Self(...), or Self(...) + addend when
+// evaluating addend before the call can't make a difference
+static Call* GetAccumulatedCall(Node* value, Node** addend) {
+  if (!value || value->NodeType != NODE_BINARY) return NULL;
+
+  Binary* binary = (Binary*)value;
+  if (binary->BinaryOperator != BINARY_ADD) return NULL;
+
+  if (IsSelfCall(binary->BinaryRight)) {
+    *addend = binary->BinaryLeft;
+    return (Call*)binary->BinaryRight;
+  }
+  if (IsSelfCall(binary->BinaryLeft) && IsUnchangedByCall(binary->BinaryRight)) {
+    *addend = binary->BinaryRight;
+    return (Call*)binary->BinaryLeft;
+  }
+  return NULL;
+}
+
+static BOOL HasAccumulatedReturn(Node* node) {
+  Node* addend;
+  switch (node->NodeType) {
+    case NODE_BLOCK: {
+      Cons* statement = ((Block*)node)->BlockStatements;
+      while (statement) {
+        if (HasAccumulatedReturn(statement->Value)) return TRUE;
+        statement = statement->Tail;
+      }
+      return FALSE;
+    }
+    case NODE_IF: {
+      If* if_statement = (If*)node;
+      return HasAccumulatedReturn((Node*)if_statement->IfThenBlock)
+          || (if_statement->IfElseBlock && HasAccumulatedReturn((Node*)if_statement->IfElseBlock));
+    }
+    case NODE_WHILE: return HasAccumulatedReturn((Node*)((While*)node)->WhileBody);
+    case NODE_RETURN: return GetAccumulatedCall(((Return*)node)->ReturnValue, &addend) != NULL;
+  }
+  return FALSE;
+}
+
+// Assigns the arguments to the params and jumps back to the start of the function
+static void LowerSelfCall(Call* call) {
+  NUM argc = Length(call->CallArguments);
+  Operand args[argc ? argc : 1]; // a zero length array is undefined
+
+  NUM argument_index = 0;
+  Cons* arg          = call->CallArguments;
+  while (arg) {
+    args[argument_index++] = LowerExpression(arg->Value);
+    arg = arg->Tail;
+  }
+
+  // Params are temps 0 to argc - 1, one that's passed as another param's argument
+  // is read before that param is assigned
+  for (NUM i = 0; i < argc; i++) {
+    BOOL is_param = args[i].OperandKind == IRO_TEMP && args[i].OperandValue < argc;
+    if (!is_param || args[i].OperandValue == i) continue;
+    NUM copy = NewTemp(FALSE);
+    EmitCopy(copy, args[i]);
+    args[i] = TempOperand(copy);
+  }
+
+  for (NUM i = 0; i < argc; i++) {
+    if (args[i].OperandKind != IRO_TEMP || args[i].OperandValue != i) EmitCopy(i, args[i]);
+  }
+
+  if (EntryLabel < 0) EntryLabel = NextLabel++;
+  EmitJump(IR_JMP, NoOperand, EntryLabel);
+}
+
+static void LowerReturn(Return* ret) {
+  if (IsSelfCall(ret->ReturnValue)) {
+    LowerSelfCall((Call*)ret->ReturnValue);
+    return;
+  }
+
+  Node* addend;
+  Call* call = Accumulator >= 0 ? GetAccumulatedCall(ret->ReturnValue, &addend) : NULL;
+  if (call) {
+    // addend is evaluated first when it's on the left, and doesn't matter when it's on the right
+    Operand value = LowerExpression(addend);
+    EmitCopy(Accumulator, EmitValue(IR_ADD, TempOperand(Accumulator), value));
+    LowerSelfCall(call);
+    return;
+  }
+
+  Operand value = NoOperand;
+  if (ret->ReturnValue) value = LowerExpression(ret->ReturnValue);
+  if (Accumulator >= 0) {
+    BOOL is_zero =
+        value.OperandKind == IRO_NONE || (value.OperandKind == IRO_CONST && value.OperandValue == 0);
+    value        = is_zero ? TempOperand(Accumulator) : EmitValue(IR_ADD, TempOperand(Accumulator), value);
+  }
+  AddIr(IR_RET)->IrA = value;
+}
+
+static void LowerIf(If* if_statement) {
+  NUM else_label = NextLabel++;
+  NUM end_label  = NextLabel++;
+
+  LowerBranch(if_statement->IfCondition, FALSE, else_label);
+
+  LowerBlock(if_statement->IfThenBlock);
+  EmitJump(IR_JMP, NoOperand, end_label);
+  PlaceLabel(else_label);
+
+  if (if_statement->IfElseBlock) {
+    LowerBlock(if_statement->IfElseBlock);
+  }
+  PlaceLabel(end_label);
+}
+
+static void LowerWhile(While* while_loop) {
+  NUM start_label = NextLabel++;
+  NUM done_label  = NextLabel++;
+
+  NUM OldContinueLabel = CurrentContinueLabel;
+  NUM OldBreakLabel    = CurrentBreakLabel;
+  CurrentContinueLabel = start_label;
+  CurrentBreakLabel    = done_label;
+
+  PlaceLabel(start_label);
+  LowerBranch(while_loop->WhileCondition, FALSE, done_label);
+
+  LowerBlock(while_loop->WhileBody);
+  EmitJump(IR_JMP, NoOperand, start_label);
+
+  PlaceLabel(done_label);
+
+  CurrentContinueLabel = OldContinueLabel;
+  CurrentBreakLabel    = OldBreakLabel;
+}
+
+static void LowerStatement(Node* statement) {
+  switch (statement->NodeType) {
+    case NODE_SET: LowerSet((Set*)statement); return;
+    case NODE_RETURN: LowerReturn((Return*)statement); return;
+    case NODE_IF: LowerIf((If*)statement); return;
+    case NODE_WHILE: LowerWhile((While*)statement); return;
+    case NODE_BREAK: EmitJump(IR_JMP, NoOperand, CurrentBreakLabel); return;
+    case NODE_CONTINUE: EmitJump(IR_JMP, NoOperand, CurrentContinueLabel); return;
+    case NODE_VAR: return;
+  }
+
+  LowerExpression(statement);
+}
+
+static void LowerBlock(Block* block) {
+  Cons* statements = block->BlockStatements;
+
+  while (statements) {
+    LowerStatement(statements->Value);
+    statements = statements->Tail;
+  }
+}
+
+// Variables passed to addr() or written with set8 need a memory home
+static void FindAddressTaken(Node* node) {
+  switch (node->NodeType) {
+    case NODE_BLOCK: {
+      Cons* statement = ((Block*)node)->BlockStatements;
+      while (statement) {
+	FindAddressTaken(statement->Value);
+	statement = statement->Tail;
+      }
+      return;
+    }
+    case NODE_SET: {
+      Set* set = (Set*)node;
+      if (set->SetIsEightBit && set->SetDestination->NodeType == NODE_REFERENCE)
+	TablePut(&AddressTaken, ((Reference*)set->SetDestination)->ReferenceName, set);
+      FindAddressTaken(set->SetDestination);
+      FindAddressTaken(set->SetValue);
+      return;
+    }
+    case NODE_BINARY: {
+      FindAddressTaken(((Binary*)node)->BinaryLeft);
+      FindAddressTaken(((Binary*)node)->BinaryRight);
+      return;
+    }
+    case NODE_UNARY: FindAddressTaken(((Unary*)node)->UnaryOperand); return;
+    case NODE_CALL: {
+      Call* call = (Call*)node;
+      Cons* arg  = call->CallArguments;
+      if (call->CallIntrinsic == INTRINSIC_ADDR && arg && ((Node*)arg->Value)->NodeType == NODE_REFERENCE)
+	TablePut(&AddressTaken, ((Reference*)arg->Value)->ReferenceName, call);
+
+      while (arg) {
+	FindAddressTaken(arg->Value);
+	arg = arg->Tail;
+      }
+      return;
+    }
+    case NODE_RETURN: {
+      Return* ret = (Return*)node;
+      if (ret->ReturnValue) FindAddressTaken(ret->ReturnValue);
+      return;
+    }
+    case NODE_IF: {
+      If* if_statement = (If*)node;
+      FindAddressTaken(if_statement->IfCondition);
+      FindAddressTaken((Node*)if_statement->IfThenBlock);
+      if (if_statement->IfElseBlock) FindAddressTaken((Node*)if_statement->IfElseBlock);
+      return;
+    }
+    case NODE_WHILE: {
+      While* while_loop = (While*)node;
+      FindAddressTaken(while_loop->WhileCondition);
+      FindAddressTaken((Node*)while_loop->WhileBody);
+      return;
+    }
+  }
+}
+
+// A variable gets a slot if its address is taken, else temp (or a new one if temp is -1)
+static Symbol* AddFunctionSymbol(const char* name, NUM temp) {
+  Symbol* symbol = &FunctionSymbolStorage[FunctionSymbols.TableCount];
+  TablePut(&FunctionSymbols, name, symbol);
+
+  if (TableGet(&AddressTaken, name)) {
+    symbol->SymbolKind  = SYM_SLOT;
+    symbol->SymbolValue = SlotCount++;
+  } else {
+    symbol->SymbolKind  = SYM_TEMP;
+    symbol->SymbolValue = temp >= 0 ? temp : NewTemp(TRUE);
+  }
+  return symbol;
+}
+
+// Params are temps 0 to argc - 1, stored to a slot at entry if their address is taken
+static void BuildFunctionSymbols(Fn* fn) {
+  NUM argc          = Length(fn->FnParamNames);
+  NUM symbols_count = argc + Length(fn->FnBlock->BlockStatements);
+
+  if (symbols_count > FunctionSymbolCapacity) {
+    FunctionSymbolCapacity = symbols_count * 2;
+    FunctionSymbolStorage  = realloc(FunctionSymbolStorage, FunctionSymbolCapacity * sizeof(Symbol));
+  }
+  TableClear(&FunctionSymbols);
+  TableClear(&AddressTaken);
+  FindAddressTaken((Node*)fn->FnBlock);
+
+  for (NUM i = 0; i < argc; i++)
+    NewTemp(TRUE);
+
+  NUM argument_index  = 0;
+  Cons* argument_list = fn->FnParamNames;
+  while (argument_list) {
+    Symbol* symbol = AddFunctionSymbol(argument_list->Value, argument_index);
+    if (symbol->SymbolKind == SYM_SLOT)
+      EmitStore(IR_STORE, (Operand){ IRO_SLOT, symbol->SymbolValue }, TempOperand(argument_index));
+
+    argument_index++;
+    argument_list = argument_list->Tail;
+  }
+
+  Cons* statement_list = fn->FnBlock->BlockStatements;
+  while (statement_list) {
+    Node* statement = statement_list->Value;
+    statement_list  = statement_list->Tail;
+
+    if (statement->NodeType == NODE_VAR) AddFunctionSymbol(((Var*)statement)->VarName, -1);
+  }
+}
+
+// Whether every name the node reads or writes is a local or a global declared so far.
+// Called names aren't checked, functions can be defined after their callers.
+static BOOL IsResolved(Node* node) {
+  switch (node->NodeType) {
+    case NODE_REFERENCE: {
+      const char* name = ((Reference*)node)->ReferenceName;
+      return TableGet(&FunctionSymbols, name) || TableGet(&GlobalSymbols, name);
+    }
+    case NODE_BLOCK: {
+      Cons* statement = ((Block*)node)->BlockStatements;
+      while (statement) {
+	if (!IsResolved(statement->Value)) return FALSE;
+	statement = statement->Tail;
+      }
+      return TRUE;
+    }
+    case NODE_SET: {
+      Set* set = (Set*)node;
+      return IsResolved(set->SetDestination) && IsResolved(set->SetValue);
+    }
+    case NODE_BINARY: {
+      Binary* binary = (Binary*)node;
+      return IsResolved(binary->BinaryLeft) && IsResolved(binary->BinaryRight);
+    }
+    case NODE_UNARY: return IsResolved(((Unary*)node)->UnaryOperand);
+    case NODE_CALL: {
+      Cons* arg = ((Call*)node)->CallArguments;
+      while (arg) {
+	if (!IsResolved(arg->Value)) return FALSE;
+	arg = arg->Tail;
+      }
+      return TRUE;
+    }
+    case NODE_RETURN: {
+      Return* ret = (Return*)node;
+      return !ret->ReturnValue || IsResolved(ret->ReturnValue);
+    }
+    case NODE_IF: {
+      If* if_statement = (If*)node;
+      return IsResolved(if_statement->IfCondition) && IsResolved((Node*)if_statement->IfThenBlock)
+          && (!if_statement->IfElseBlock || IsResolved((Node*)if_statement->IfElseBlock));
+    }
+    case NODE_WHILE: {
+      While* while_loop = (While*)node;
+      return IsResolved(while_loop->WhileCondition) && IsResolved((Node*)while_loop->WhileBody);
+    }
+  }
+  return TRUE;
+}
+
+// Whether fn can be lowered with the globals declared so far. With -stream, functions
+// that use a const, static or extern declared further down wait for the end of the input.
+BOOL CanLowerFn(Fn* fn) {
+  UpdateGlobalSymbols();
+
+  TableClear(&FunctionSymbols);
+  Cons* param = fn->FnParamNames;
+  while (param) {
+    TablePut(&FunctionSymbols, param->Value, param);
+    param = param->Tail;
+  }
+
+  Cons* statement = fn->FnBlock->BlockStatements;
+  while (statement) {
+    Node* node = statement->Value;
+    if (node->NodeType == NODE_VAR) TablePut(&FunctionSymbols, ((Var*)node)->VarName, node);
+    statement = statement->Tail;
+  }
+
+  return IsResolved((Node*)fn->FnBlock);
+}
+
+IrFn* LowerFn(Fn* fn) {
+  UpdateGlobalSymbols();
+
+  CodeCount = 0;
+  TempCount = 0;
+  SlotCount = 0;
+  NextLabel = 0;
+
+  BuildFunctionSymbols(fn);
+
+  CurrentFn   = fn;
+  EntryLabel  = -1;
+  Accumulator = -1;
+  if (SlotCount == 0 && HasAccumulatedReturn((Node*)fn->FnBlock)) {
+    Accumulator = NewTemp(TRUE);
+    EmitCopy(Accumulator, ConstOperand(0));
+  }
+  EntryPosition = CodeCount;
+
+  LowerBlock(fn->FnBlock);
+  AddIr(IR_RET)->IrA = Accumulator >= 0 ? TempOperand(Accumulator) : NoOperand;
+
+  if (EntryLabel >= 0) {
+    AddIr(IR_NOP);
+    memmove(&Code[EntryPosition + 1], &Code[EntryPosition], (CodeCount - EntryPosition - 1) * sizeof(Ir));
+    memset(&Code[EntryPosition], 0, sizeof(Ir));
+    Code[EntryPosition].IrOp    = IR_LABEL;
+    Code[EntryPosition].IrDst   = -1;
+    Code[EntryPosition].IrLabel = EntryLabel;
+  }
+
+  IrFn* ir_fn               = ArenaAlloc(sizeof(IrFn));
+  ir_fn->IrFnName           = fn->FnName;
+  ir_fn->IrFnParamCount     = Length(fn->FnParamNames);
+  ir_fn->IrFnCodeCount      = CodeCount;
+  ir_fn->IrFnCode           = ArenaAlloc(CodeCount * sizeof(Ir));
+  ir_fn->IrFnTempCount      = TempCount;
+  ir_fn->IrFnTempIsVariable = ArenaAlloc(TempCount * sizeof(BOOL));
+  ir_fn->IrFnSlotCount      = SlotCount;
+
+  // Code and TempIsVariable are NULL until this thread adds something to them
+  if (CodeCount) memcpy(ir_fn->IrFnCode, Code, CodeCount * sizeof(Ir));
+  if (TempCount) memcpy(ir_fn->IrFnTempIsVariable, TempIsVariable, TempCount * sizeof(BOOL));
+  return ir_fn;
+}
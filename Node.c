@@ -1,119 +1,140 @@
 #include "Node.h"
 
-static void NewLine(NUM indent) {
-  printf("\n");
+static void NewLine(FILE* out, NUM indent) {
+  fprintf(out, "\n");
   for (int i = 0; i < indent; i++)
-    printf("  ");
+    fprintf(out, "  ");
 }
 
-static void PrintVar(Var* var, NUM indent) {
-  printf("var %s;", var->VarName);
+static void PrintVar(FILE* out, Var* var, NUM indent) {
+  fprintf(out, "var %s;", var->VarName);
 }
 
-static void PrintNumber(Number* number, NUM indent) {
-  printf("%ld", number->NumberValue);
+static void PrintNumber(FILE* out, Number* number, NUM indent) {
+  fprintf(out, "%ld", number->NumberValue);
 }
 
-static void PrintCall(Call* call, NUM indent) {
-  printf("%s", ((Fn*)call->CallFunction)->FnName);
+static void PrintCall(FILE* out, Call* call, NUM indent) {
+  fprintf(out, "%s", ((Fn*)call->CallFunction)->FnName);
   
-  printf("(");
+  fprintf(out, "(");
   Cons* arg = call->CallArguments;
   while (arg) {
-    PrintNode(arg->Value, indent);
+    PrintNode(out, arg->Value, indent);
     arg = arg->Tail;
-    if (arg) printf(", ");
+    if (arg) fprintf(out, ", ");
   }
 
-  printf(")");
+  fprintf(out, ")");
 }
 
-static void PrintIf(If* if_statement, NUM indent) {
-  printf("if ");
-  PrintNode(if_statement->IfCondition, indent);
-  printf(" ");
-  PrintNode((Node*)if_statement->IfThenBlock, indent);
+/* clang-format off */
+static const char* BinaryOperatorNames[BINARY_COUNT] = {
+  "+", "-", "*", "&", "|", "/", "%", "<<", ">>", ">>>", "<", "<=", ">", ">=", "==", "!=", "&&", "||", "->",
+};
+/* clang-format on */
+
+static void PrintBinary(FILE* out, Binary* binary, NUM indent) {
+  fprintf(out, "(");
+  PrintNode(out, binary->BinaryLeft, indent);
+  fprintf(out, " %s ", BinaryOperatorNames[binary->BinaryOperator]);
+  PrintNode(out, binary->BinaryRight, indent);
+  fprintf(out, ")");
+}
+
+static void PrintUnary(FILE* out, Unary* unary, NUM indent) {
+  fprintf(out, unary->UnaryOperator == UNARY_NEG ? "-" : "!");
+  PrintNode(out, unary->UnaryOperand, indent);
+}
+
+static void PrintIf(FILE* out, If* if_statement, NUM indent) {
+  fprintf(out, "if ");
+  PrintNode(out, if_statement->IfCondition, indent);
+  fprintf(out, " ");
+  PrintNode(out, (Node*)if_statement->IfThenBlock, indent);
 
   if (if_statement->IfElseBlock) {
-    printf(" else ");
-    PrintNode((Node*)if_statement->IfElseBlock, indent);
+    fprintf(out, " else ");
+    PrintNode(out, (Node*)if_statement->IfElseBlock, indent);
   }
 }
 
-static void PrintWhile(While* while_loop, NUM indent) {
-  printf("while ");
-  PrintNode(while_loop->WhileCondition, indent);
-  printf(" ");
-  PrintNode((Node*)while_loop->WhileBody, indent);
+static void PrintWhile(FILE* out, While* while_loop, NUM indent) {
+  fprintf(out, "while ");
+  PrintNode(out, while_loop->WhileCondition, indent);
+  fprintf(out, " ");
+  PrintNode(out, (Node*)while_loop->WhileBody, indent);
 }
 
-static void PrintReference(Reference* ref, NUM indent) {
-  printf("%s", ref->ReferenceName);
+static void PrintReference(FILE* out, Reference* ref, NUM indent) {
+  fprintf(out, "%s", ref->ReferenceName);
 }
 
-static void PrintSet(Set* set, NUM indent) {
-  printf("set ");
-  PrintNode(set->SetDestination, indent);
-  printf(" = ");
-  PrintNode(set->SetValue, indent);
-  printf(";");
+static void PrintSet(FILE* out, Set* set, NUM indent) {
+  fprintf(out, "set ");
+  PrintNode(out, set->SetDestination, indent);
+  fprintf(out, " = ");
+  PrintNode(out, set->SetValue, indent);
+  fprintf(out, ";");
 }
 
-static void PrintReturn(Return* ret, NUM indent) {
-  printf("return ");
-  PrintNode(ret->ReturnValue, indent);
-  printf(";");
+static void PrintReturn(FILE* out, Return* ret, NUM indent) {
+  fprintf(out, "return ");
+  PrintNode(out, ret->ReturnValue, indent);
+  fprintf(out, ";");
 }
 
-static void PrintBlock(Block* block, NUM indent) {
-  printf("{");
+static void PrintBlock(FILE* out, Block* block, NUM indent) {
+  fprintf(out, "{");
 
   Cons* statement = block->BlockStatements;
   while (statement) {
-    NewLine(indent + 1);
-    PrintNode(statement->Value, indent + 1);
+    NewLine(out, indent + 1);
+    PrintNode(out, statement->Value, indent + 1);
     statement = statement->Tail;
   }
 
-  NewLine(indent);
-  printf("}");
+  NewLine(out, indent);
+  fprintf(out, "}");
 }
 
-static void PrintFn(Fn* fn, NUM indent) {
-  printf("fn %s(", fn->FnName);
+static void PrintFn(FILE* out, Fn* fn, NUM indent) {
+  fprintf(out, "fn %s(", fn->FnName);
 
   Cons* param = fn->FnParamNames;
   while (param) {
-    printf("%s", (char*)param->Value);
+    fprintf(out, "%s", (char*)param->Value);
     param = param->Tail;
-    if (param) printf(", ");
+    if (param) fprintf(out, ", ");
   }
-  printf(") ");
-  PrintBlock(fn->FnBlock, indent);
+  fprintf(out, ") ");
+  PrintBlock(out, fn->FnBlock, indent);
 }
 
-static void PrintBreak(Break* node, NUM indent) {
-  printf("break");
+static void PrintBreak(FILE* out, Break* node, NUM indent) {
+  fprintf(out, "break");
 }
 
-static void PrintContinue(Continue* node, NUM indent) {
-  printf("continue");
+static void PrintContinue(FILE* out, Continue* node, NUM indent) {
+  fprintf(out, "continue");
 }
 
-void PrintNode(Node* node, NUM indent) {
+void PrintNode(FILE* out, Node* node, NUM indent) {
   switch (node->NodeType) {
-    case NODE_FN: return PrintFn((Fn*)node, indent);
-    case NODE_BLOCK: return PrintBlock((Block*)node, indent);
-    case NODE_VAR: return PrintVar((Var*)node, indent);
-    case NODE_SET: return PrintSet((Set*)node, indent);
-    case NODE_RETURN: return PrintReturn((Return*)node, indent);
-    case NODE_REFERENCE: return PrintReference((Reference*)node, indent);
-    case NODE_CALL: return PrintCall((Call*)node, indent);
-    case NODE_NUMBER: return PrintNumber((Number*)node, indent);
-    case NODE_IF: return PrintIf((If*)node, indent);
-    case NODE_WHILE: return PrintWhile((While*)node, indent);
-    case NODE_BREAK: return PrintBreak((Break*)node, indent);
-    case NODE_CONTINUE: return PrintContinue((Continue*)node, indent);
-    default: printf("node"); return;
+    case NODE_FN: return PrintFn(out, (Fn*)node, indent);
+    case NODE_BLOCK: return PrintBlock(out, (Block*)node, indent);
+    case NODE_VAR: return PrintVar(out, (Var*)node, indent);
+    case NODE_SET: return PrintSet(out, (Set*)node, indent);
+    case NODE_RETURN: return PrintReturn(out, (Return*)node, indent);
+    case NODE_REFERENCE: return PrintReference(out, (Reference*)node, indent);
+    case NODE_CALL: return PrintCall(out, (Call*)node, indent);
+    case NODE_BINARY: return PrintBinary(out, (Binary*)node, indent);
+    case NODE_UNARY: return PrintUnary(out, (Unary*)node, indent);
+    case NODE_NUMBER: return PrintNumber(out, (Number*)node, indent);
+    case NODE_IF: return PrintIf(out, (If*)node, indent);
+    case NODE_WHILE: return PrintWhile(out, (While*)node, indent);
+    case NODE_BREAK: return PrintBreak(out, (Break*)node, indent);
+    case NODE_CONTINUE: return PrintContinue(out, (Continue*)node, indent);
+    default: fprintf(out, "node"); return;
   }
 }
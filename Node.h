@@ -14,12 +14,13 @@ enum NodeTypeEnum {
   NODE_SET,
   NODE_REFERENCE,
   NODE_CALL,
-  NODE_INFIX,
+  NODE_BINARY,
   NODE_IF,
   NODE_WHILE,
   NODE_STRING,
   NODE_BREAK,
   NODE_CONTINUE,
+  NODE_UNARY,
 };
 typedef NUM NodeType;
 
@@ -42,6 +43,7 @@ typedef struct Fn {
   const char* FnName;
   Cons* FnParamNames;
   Block* FnBlock;
+  BOOL FnInline; // declared with inline, inlined whatever its size
 } Fn;
 
 typedef struct Return {
@@ -66,12 +68,68 @@ typedef struct Reference {
   const char* ReferenceName;
 } Reference;
 
+// Calls that are built into the language, resolved by name when the call is parsed
+enum IntrinsicEnum {
+  INTRINSIC_NONE = 0,
+  INTRINSIC_GET,  // get(address), the 64 bits at address
+  INTRINSIC_GET8, // get8(address), the byte at address, zero extended
+  INTRINSIC_ADDR, // addr(name), the address of a variable
+
+  INTRINSIC_COUNT,
+};
+typedef NUM Intrinsic;
+
 typedef struct Call {
   NodeType NodeType; // NODE_CALL
   Node* CallFunction;
   Cons* CallArguments;
+  Intrinsic CallIntrinsic;
 } Call;
 
+enum BinaryOperatorEnum {
+  BINARY_ADD,
+  BINARY_SUB,
+  BINARY_MUL,
+  BINARY_BAND,
+  BINARY_BOR,
+  BINARY_DIV,   // signed, rounds towards 0
+  BINARY_MOD,   // signed, has the sign of the left operand
+  BINARY_SHL,   // <<
+  BINARY_SAR,   // >>, shifts in the sign bit
+  BINARY_SHR,   // >>>, shifts in zeros
+  BINARY_LT,
+  BINARY_LE,
+  BINARY_GT,
+  BINARY_GE,
+  BINARY_EQ,
+  BINARY_NE,
+  BINARY_AND,   // &&, short-circuiting, 0 or 1
+  BINARY_OR,    // ||
+  BINARY_ARROW, // a -> b, the 64 bits at a + b
+
+  BINARY_COUNT,
+};
+typedef NUM BinaryOperator;
+
+typedef struct Binary {
+  NodeType NodeType; // NODE_BINARY
+  BinaryOperator BinaryOperator;
+  Node* BinaryLeft;
+  Node* BinaryRight;
+} Binary;
+
+enum UnaryOperatorEnum {
+  UNARY_NEG, // -a
+  UNARY_NOT, // !a, 1 if a is 0 and 0 otherwise
+};
+typedef NUM UnaryOperator;
+
+typedef struct Unary {
+  NodeType NodeType; // NODE_UNARY
+  UnaryOperator UnaryOperator;
+  Node* UnaryOperand;
+} Unary;
+
 typedef struct If {
   NodeType NodeType; // NODE_IF
   Node* IfCondition;
@@ -99,4 +157,6 @@ typedef struct Continue {
   NodeType NodeType; // NODE_CONTINUE
 } Continue;
 
-void PrintNode(Node* node, NUM indent);
+void PrintNode(FILE* out, Node* node, NUM indent);
+void FoldFunction(Fn* fn);
+void CodegenFunction(Fn* fn);
@@ -0,0 +1,69 @@
+#pragma once
+#include "Common.h"
+
+// The relocatable object being built from the encoder's output (Encode.c), written out as ELF64 by
+// WriteObject (Elf.c)
+
+typedef struct Buffer {
+  uint8_t* BufferData;
+  NUM BufferCount;
+  NUM BufferCapacity;
+} Buffer;
+
+void BufferWrite(Buffer* buffer, const void* data, NUM size);
+
+enum ObjSectionEnum {
+  OBJ_UNDEFINED = 0,
+  OBJ_TEXT = 1,
+  OBJ_RODATA = 2,
+  OBJ_BSS = 3,
+
+  OBJ_SECTION_COUNT,
+};
+typedef NUM ObjSection;
+
+typedef struct ObjSymbol {
+  const char* ObjSymbolName; // interned, NULL for section symbols
+  ObjSection ObjSymbolSection;
+  NUM ObjSymbolValue;
+  BOOL ObjSymbolGlobal;
+  NUM ObjSymbolIndex; // in .symtab, assigned by WriteObject
+} ObjSymbol;
+
+typedef struct ObjReloc {
+  NUM RelocOffset; // in .text
+  NUM RelocType;
+  ObjSymbol* RelocSymbol;
+  NUM RelocAddend;
+  NUM RelocString; // label of the string whose .rodata offset is added to the addend, -1 if none
+  const char* RelocName; // the symbol of an ObjFunction relocation, RelocSymbol is NULL until it's added
+} ObjReloc;
+
+// A function encoded on its own, so that functions can be encoded in parallel.
+// Its relocations are from the start of FunctionCode and name their symbol,
+// AddObjFunction turns them into real ones when it adds the code to .text.
+typedef struct ObjFunction {
+  const char* FunctionName;
+  Buffer FunctionCode;
+  ObjReloc* FunctionRelocs;
+  NUM FunctionRelocsCount;
+  NUM FunctionRelocsCapacity;
+} ObjFunction;
+
+extern Buffer ObjText;
+extern Buffer ObjRodata;
+extern NUM ObjBssSize;
+
+// Returns the symbol called name, undefined until its section is set
+ObjSymbol* GetObjSymbol(const char* name);
+ObjSymbol* GetSectionSymbol(ObjSection section);
+
+void AddObjString(NUM label, const char* str);
+void AddObjStatic(const char* name);
+void AddObjReloc(NUM offset, NUM type, ObjSymbol* symbol, NUM addend);
+void AddObjFunction(ObjFunction* function);
+
+// A PC32 reference to string label, which doesn't need to be added yet
+void AddObjStringReloc(NUM offset, NUM label, NUM addend);
+
+BOOL WriteObject(const char* path);
@@ -3,138 +3,188 @@
 #include "Cons.h"
 #include "Token.h"
 #include "Node.h"
+#include "Arena.h"
+#include "Intern.h"
 #include <string.h>
 
 
-Node* ParseExpression(Cons** stream, TokenType delimiter1, TokenType delimiter2);
-Block* ParseBlock(Cons** stream);
-Var* ParseVar(Cons** stream, BOOL is_static);
-Set* ParseSet(Cons** stream, BOOL is_eight_bit);
-Return* ParseReturn(Cons** stream);
-Node* ParseStatement(Cons** stream);
-If* ParseIf(Cons** stream);
-While* ParseWhile(Cons** stream);
-Fn* ParseFn(Cons** stream);
-BOOL ParseExtern(Cons** stream);
-Node* ParseBreakContinue(Cons** stream, BOOL is_continue);
-
-BOOL IsInfix(TokenType tt) {
-  return tt == '&' || tt == '|' || tt == '+' || tt == '-' || tt == '*' || tt == '/' || tt == '<' || tt == '>'
-      || tt == TOK_DOUBLE_EQUAL || tt == TOK_NOT_EQUAL || tt == TOK_GREATER_THAN || tt == TOK_LESS_THAN
-      || tt == TOK_GREATER_THAN_EQUAL || tt == TOK_LESS_THAN_EQUAL || tt == TOK_DOUBLE_AND
-      || tt == TOK_DOUBLE_OR || tt == TOK_ARROW;
+Node* ParseExpression(TokenStream* stream);
+Block* ParseBlock(TokenStream* stream);
+Var* ParseVar(TokenStream* stream, BOOL is_static);
+Set* ParseSet(TokenStream* stream, BOOL is_eight_bit);
+Return* ParseReturn(TokenStream* stream);
+Node* ParseStatement(TokenStream* stream);
+If* ParseIf(TokenStream* stream);
+While* ParseWhile(TokenStream* stream);
+Fn* ParseFn(TokenStream* stream);
+BOOL ParseExtern(TokenStream* stream);
+Node* ParseBreakContinue(TokenStream* stream, BOOL is_continue);
+
+// Where ParseFile puts what it parses, per thread for -j
+static __thread Declarations* Parsed;
+
+// String literals are the one token text that outlives parsing, codegen needs it NUL terminated
+static char* CopyTokenString(Token* t) {
+  char* str = ArenaAlloc(t->TokenLength + 1);
+  memcpy(str, t->Str, t->TokenLength);
+  str[t->TokenLength] = 0;
+  return str;
 }
 
-Node* ParseExpression(Cons** stream, TokenType delimiter1, TokenType delimiter2) {
-  Node* so_far            = NULL;
-  Node* infix_lhs         = NULL;
-  Token* hanging_operator = NULL;
-  Token* t                = NULL;
+typedef struct InfixOperator {
+  BinaryOperator InfixBinary;
+  NUM InfixPrecedence; // higher binds tighter, 0 if the token isn't a binary operator
+} InfixOperator;
+
+/* clang-format off */
+static const InfixOperator InfixOperators[256] = {
+  [TOK_DOUBLE_OR]  = { BINARY_OR, 1 },
+  [TOK_DOUBLE_AND] = { BINARY_AND, 2 },
+  ['|']            = { BINARY_BOR, 3 },
+  ['&']            = { BINARY_BAND, 4 },
+  [TOK_DOUBLE_EQUAL] = { BINARY_EQ, 5 }, [TOK_NOT_EQUAL] = { BINARY_NE, 5 },
+  ['<'] = { BINARY_LT, 6 }, [TOK_LESS_THAN] = { BINARY_LT, 6 },
+  ['>'] = { BINARY_GT, 6 }, [TOK_GREATER_THAN] = { BINARY_GT, 6 },
+  [TOK_LESS_THAN_EQUAL] = { BINARY_LE, 6 }, [TOK_GREATER_THAN_EQUAL] = { BINARY_GE, 6 },
+  [TOK_SHIFT_LEFT] = { BINARY_SHL, 7 }, [TOK_SHIFT_RIGHT] = { BINARY_SAR, 7 },
+  [TOK_LOGICAL_SHIFT_RIGHT] = { BINARY_SHR, 7 },
+  ['+'] = { BINARY_ADD, 8 }, ['-'] = { BINARY_SUB, 8 },
+  ['*'] = { BINARY_MUL, 9 }, ['/'] = { BINARY_DIV, 9 }, ['%'] = { BINARY_MOD, 9 },
+  [TOK_ARROW] = { BINARY_ARROW, 11 },
+};
+/* clang-format on */
+
+// Unary - and ! bind tighter than every binary operator but ->
+#define PRECEDENCE_UNARY 10
+
+static const InfixOperator* GetInfixOperator(TokenType tt) {
+  static const InfixOperator none = { 0 };
+  if (tt < 0 || tt >= 256) return &none;
+  return &InfixOperators[tt];
+}
 
-  while (1) {
-    if (hanging_operator && infix_lhs) {
-      Reference* pseudo_fn     = malloc(sizeof(Reference));
-      pseudo_fn->NodeType      = NODE_REFERENCE;
-      pseudo_fn->ReferenceName = hanging_operator->Str;
-
-      Call* call          = malloc(sizeof(Call));
-      call->NodeType      = NODE_CALL;
-      call->CallFunction  = (Node*)pseudo_fn;
-      call->CallArguments = NULL;
-
-      call->CallArguments = Append(&call->CallArguments, infix_lhs);
-      call->CallArguments = Append(&call->CallArguments, so_far);
-
-      so_far           = (Node*)call;
-      infix_lhs        = NULL;
-      hanging_operator = NULL;
-    }
+static Node* MakeBinary(BinaryOperator op, Node* lhs, Node* rhs) {
+  Binary* binary         = ArenaAlloc(sizeof(Binary));
+  binary->NodeType       = NODE_BINARY;
+  binary->BinaryOperator = op;
+  binary->BinaryLeft     = lhs;
+  binary->BinaryRight    = rhs;
+  return (Node*)binary;
+}
 
-    if (Peek(stream) == delimiter1 || Peek(stream) == delimiter2) {
-      return so_far;
-    }
+static Node* ParseBinary(TokenStream* stream, NUM min_precedence);
 
-    t = Pop(stream);
+// A name, number, string, parenthesized expression or unary operator, followed by any calls
+static Node* ParseOperand(TokenStream* stream) {
+  Token* t = Pop(stream);
+  if (!t) return NULL;
 
-    if (t->TokenType == TOK_ID) {
-      infix_lhs          = so_far;
-      Reference* ref     = malloc(sizeof(Reference));
+  Node* operand = NULL;
+  switch (t->TokenType) {
+    case TOK_ID: {
+      Reference* ref     = ArenaAlloc(sizeof(Reference));
       ref->NodeType      = NODE_REFERENCE;
       ref->ReferenceName = t->Str;
-      so_far             = (Node*)ref;
-      continue;
+      operand            = (Node*)ref;
+      break;
     }
-
-    if (t->TokenType == TOK_NUMBER) {
-      infix_lhs        = so_far;
-      Number* num      = malloc(sizeof(Number));
+    case TOK_NUMBER: {
+      Number* num      = ArenaAlloc(sizeof(Number));
       num->NodeType    = NODE_NUMBER;
       num->NumberValue = t->TokenNumber;
-      so_far           = (Node*)num;
-      continue;
+      operand          = (Node*)num;
+      break;
     }
-
-    if (t->TokenType == TOK_STRING) {
-      infix_lhs        = so_far;
-      String* str      = malloc(sizeof(String));
-      str->NodeType    = NODE_STRING;
-      str->StringStr   = t->Str;
-      so_far           = (Node*)str;
-
-      Strings = Append(&Strings, str);
-      continue;
+    case TOK_STRING: {
+      // Strings are emitted after all functions, they outlive the function they're in
+      BOOL was_permanent = SetArenaPermanent(TRUE);
+      String* str        = ArenaAlloc(sizeof(String));
+      str->NodeType      = NODE_STRING;
+      str->StringStr     = CopyTokenString(t);
+      operand            = (Node*)str;
+
+      Push(&Parsed->DeclaredStrings, str);
+      SetArenaPermanent(was_permanent);
+      break;
     }
+    case '(': {
+      operand = ParseExpression(stream);
+      if (!operand || !Expect(stream, ')')) return NULL;
+      break;
+    }
+    case '-':
+    case '!': {
+      Unary* unary         = ArenaAlloc(sizeof(Unary));
+      unary->NodeType      = NODE_UNARY;
+      unary->UnaryOperator = t->TokenType == '-' ? UNARY_NEG : UNARY_NOT;
+      unary->UnaryOperand  = ParseBinary(stream, PRECEDENCE_UNARY);
+      if (!unary->UnaryOperand) return NULL;
+      return (Node*)unary;
+    }
+    default: {
+      fprintf(stderr, "Unexpected token in expression: %ld - '%.*s'\n", t->TokenType, (int)t->TokenLength,
+              t->Str);
+      return NULL;
+    }
+  }
+
+  while (Peek(stream) == '(') {
+    Pop(stream);
 
-    if (t->TokenType == '(') {
-      if (!hanging_operator && so_far) {
-	// Function call
-	Call* call         = malloc(sizeof(Call));
-	call->NodeType     = NODE_CALL;
-	call->CallFunction = so_far;
-
-	// Parse argument list
-	call->CallArguments = NULL;
-	if (Peek(stream) == ')') {
-	  Pop(stream);
-	} else {
-	  while (1) {
-	    Node* argument = ParseExpression(stream, ',', ')');
-	    if (!argument) return NULL;
-	    call->CallArguments = Append(&call->CallArguments, argument);
-
-	    Token* tok = Pop(stream);
-	    if (tok->TokenType == ')') break;
-	    if (tok->TokenType != ',') return NULL;
-	  }
-	}
-
-	infix_lhs          = NULL;
-	so_far = (Node*)call;
-	continue;
-      } else {
-	infix_lhs          = so_far;
-	so_far = ParseExpression(stream, ')', ')');
-	if (!so_far) return NULL;
-
-	Pop(stream);
-	continue;
+    Call* call          = ArenaAlloc(sizeof(Call));
+    call->NodeType      = NODE_CALL;
+    call->CallFunction  = operand;
+    call->CallIntrinsic = INTRINSIC_NONE;
+    if (operand->NodeType == NODE_REFERENCE)
+      call->CallIntrinsic = GetAtomIntrinsic(((Reference*)operand)->ReferenceName);
+
+    // Parse argument list
+    ConsList arguments = { NULL };
+    if (Peek(stream) == ')') {
+      Pop(stream);
+    } else {
+      while (1) {
+	Node* argument = ParseExpression(stream);
+	if (!argument) return NULL;
+	Push(&arguments, argument);
+
+	Token* tok = Pop(stream);
+	if (!tok) return NULL;
+	if (tok->TokenType == ')') break;
+	if (tok->TokenType != ',') return NULL;
       }
     }
+    call->CallArguments = arguments.ListHead;
+    operand             = (Node*)call;
+  }
 
-    if (IsInfix(t->TokenType)) {
-      hanging_operator = t;
-      continue;
-    }
+  return operand;
+}
 
-    fprintf(stderr, "Unexpected token in expression: %ld - '%s'\n", t->TokenType, t->Str);
-    return NULL;
+// Precedence climbing: parses operators that bind at least as tightly as min_precedence,
+// the right operand only takes tighter ones so that equal precedence associates left
+static Node* ParseBinary(TokenStream* stream, NUM min_precedence) {
+  Node* lhs = ParseOperand(stream);
+  if (!lhs) return NULL;
+
+  while (1) {
+    const InfixOperator* op = GetInfixOperator(Peek(stream));
+    if (!op->InfixPrecedence || op->InfixPrecedence < min_precedence) return lhs;
+    Pop(stream);
+
+    Node* rhs = ParseBinary(stream, op->InfixPrecedence + 1);
+    if (!rhs) return NULL;
+    lhs = MakeBinary(op->InfixBinary, lhs, rhs);
   }
+}
 
-  return NULL;
+// Parses the longest expression at the start of the stream, the caller checks what comes after it
+Node* ParseExpression(TokenStream* stream) {
+  return ParseBinary(stream, 1);
 }
 
-Var* ParseVar(Cons** stream, BOOL is_static) {
-  Var* var      = malloc(sizeof(Var));
+Var* ParseVar(TokenStream* stream, BOOL is_static) {
+  Var* var      = ArenaAlloc(sizeof(Var));
   var->NodeType = NODE_VAR;
 
   Token* tok = Expect(stream, TOK_ID);
@@ -145,38 +195,38 @@ Var* ParseVar(Cons** stream, BOOL is_static) {
   return var;
 }
 
-Set* ParseSet(Cons** stream, BOOL is8) {
-  Set* set           = malloc(sizeof(Set));
+Set* ParseSet(TokenStream* stream, BOOL is8) {
+  Set* set           = ArenaAlloc(sizeof(Set));
   set->NodeType      = NODE_SET;
   set->SetIsEightBit = is8;
 
-  set->SetDestination = ParseExpression(stream, '=', '=');
+  set->SetDestination = ParseExpression(stream);
   if (!set->SetDestination) return NULL;
 
   if (!Expect(stream, '=')) return NULL;
 
-  set->SetValue = ParseExpression(stream, ';', ';');
+  set->SetValue = ParseExpression(stream);
   if (!set->SetValue) return NULL;
 
   if (!Expect(stream, ';')) return NULL;
   return set;
 }
 
-Return* ParseReturn(Cons** stream) {
-  Return* ret      = malloc(sizeof(Return));
+Return* ParseReturn(TokenStream* stream) {
+  Return* ret      = ArenaAlloc(sizeof(Return));
   ret->NodeType    = NODE_RETURN;
-  ret->ReturnValue = ParseExpression(stream, ';', ';');
+  ret->ReturnValue = ParseExpression(stream);
   if (!ret->ReturnValue) return NULL;
   if (!Expect(stream, ';')) return NULL;
   return ret;
 }
 
-If* ParseIf(Cons** stream) {
-  If* if_statement       = malloc(sizeof(If));
+If* ParseIf(TokenStream* stream) {
+  If* if_statement       = ArenaAlloc(sizeof(If));
   if_statement->NodeType = NODE_IF;
 
   // Parse condition
-  if_statement->IfCondition = ParseExpression(stream, '{', '{');
+  if_statement->IfCondition = ParseExpression(stream);
   if (!if_statement->IfCondition) return NULL;
 
   // Parse then block
@@ -195,12 +245,12 @@ If* ParseIf(Cons** stream) {
   return if_statement;
 }
 
-While* ParseWhile(Cons** stream) {
-  While* while_loop    = malloc(sizeof(While));
+While* ParseWhile(TokenStream* stream) {
+  While* while_loop    = ArenaAlloc(sizeof(While));
   while_loop->NodeType = NODE_WHILE;
 
   // Parse condition
-  while_loop->WhileCondition = ParseExpression(stream, '{', '{');
+  while_loop->WhileCondition = ParseExpression(stream);
   if (!while_loop->WhileCondition) return NULL;
 
   // Parse then block
@@ -210,7 +260,7 @@ While* ParseWhile(Cons** stream) {
   return while_loop;
 }
 
-Node* ParseStatement(Cons** stream) {
+Node* ParseStatement(TokenStream* stream) {
   TokenType tt = Peek(stream);
   if (tt == TOK_NONE) return NULL;
 
@@ -223,32 +273,33 @@ Node* ParseStatement(Cons** stream) {
   if (tt == TOK_BREAK) { Pop(stream); return (Node*)ParseBreakContinue(stream, FALSE); }
   if (tt == TOK_CONTINUE) { Pop(stream); return (Node*)ParseBreakContinue(stream, TRUE); }
 
-  Node* expr = ParseExpression(stream, ';', ';');
+  Node* expr = ParseExpression(stream);
   if (!expr) return NULL;
 
-  Pop(stream); // semicolon
+  if (!Expect(stream, ';')) return NULL;
   return expr;
 }
 
-Block* ParseBlock(Cons** stream) {
+Block* ParseBlock(TokenStream* stream) {
   if (!Expect(stream, '{')) return NULL;
 
-  Block* block           = malloc(sizeof(Block));
-  block->NodeType        = NODE_BLOCK;
-  block->BlockStatements = NULL;
+  Block* block    = ArenaAlloc(sizeof(Block));
+  block->NodeType = NODE_BLOCK;
 
+  ConsList statements = { NULL };
   while (Peek(stream) != '}') {
     Node* statement = ParseStatement(stream);
     if (!statement) return NULL;
-    block->BlockStatements = Append(&block->BlockStatements, statement);
+    Push(&statements, statement);
   }
+  block->BlockStatements = statements.ListHead;
 
   if (!Expect(stream, '}')) return NULL;
   return block;
 }
 
-Fn* ParseFn(Cons** stream) {
-  Fn* fn       = malloc(sizeof(Fn));
+Fn* ParseFn(TokenStream* stream) {
+  Fn* fn       = ArenaAlloc(sizeof(Fn));
   fn->NodeType = NODE_FN;
 
   Token* tok;
@@ -256,10 +307,11 @@ Fn* ParseFn(Cons** stream) {
   // Parse fn nfame
   tok = Expect(stream, TOK_ID);
   if (!tok) return NULL;
-  fn->FnName = tok->Str;
+  fn->FnName   = tok->Str;
+  fn->FnInline = FALSE;
 
   // Parse fn paramters
-  fn->FnParamNames = NULL;
+  ConsList params = { NULL };
 
   if (!Expect(stream, '(')) return NULL;
 
@@ -270,13 +322,14 @@ Fn* ParseFn(Cons** stream) {
       tok = Expect(stream, TOK_ID);
       if (!tok) return NULL;
 
-      fn->FnParamNames = Append(&fn->FnParamNames, tok->Str);
+      Push(&params, tok->Str);
 
       tok = Pop(stream);
       if (tok->TokenType == ')') break;
       if (tok->TokenType != ',') return NULL;
     }
   }
+  fn->FnParamNames = params.ListHead;
 
   fn->FnBlock = ParseBlock(stream);
   if (!fn->FnBlock) return NULL;
@@ -284,18 +337,18 @@ Fn* ParseFn(Cons** stream) {
   return fn;
 }
 
-BOOL ParseExtern(Cons** stream) {
+BOOL ParseExtern(TokenStream* stream) {
   Token* name = Expect(stream, TOK_ID);
   if (!name) return FALSE;
 
-  Externs = Append(&Externs, name->Str);
+  Push(&Parsed->DeclaredExterns, name->Str);
 
   if (!Expect(stream, ';')) return FALSE;
   return TRUE;
 }
 
-BOOL ParseConst(Cons** stream) {
-  Const* constant = malloc(sizeof(Const));
+BOOL ParseConst(TokenStream* stream) {
+  Const* constant = ArenaAlloc(sizeof(Const));
 
   Token* tok = Expect(stream, TOK_ID);
   if (!tok) return FALSE;
@@ -307,52 +360,59 @@ BOOL ParseConst(Cons** stream) {
   if (!num) return FALSE;
   constant->ConstValue = num->TokenNumber;
 
-  Consts = Append(&Consts, constant);
+  Push(&Parsed->DeclaredConsts, constant);
 
   if (!Expect(stream, ';')) return FALSE;
   return TRUE;
 }
 
-Node* ParseBreakContinue(Cons** stream, BOOL is_continue) {
-  Node* node = malloc(sizeof(Node));
+Node* ParseBreakContinue(TokenStream* stream, BOOL is_continue) {
+  Node* node = ArenaAlloc(sizeof(Node));
   node->NodeType = is_continue ? NODE_CONTINUE : NODE_BREAK;
   if (!Expect(stream, ';')) return NULL;
   return (Node*)node;
 }
 
-BOOL ParseFile(Cons* tokens) {
-  Cons* ast    = NULL;
-  Cons* stream = tokens;
+static BOOL ParseGlobal(TokenStream* stream, Token* tok) {
+  switch (tok->TokenType) {
+    case TOK_EXTERN: return ParseExtern(stream);
+    case TOK_CONST: return ParseConst(stream);
+    case TOK_STATIC: {
+      Var* var = ParseVar(stream, TRUE);
+      if (!var) return FALSE;
+      Push(&Parsed->DeclaredStatics, var);
+      return TRUE;
+    }
+  }
+
+  return TRUE;
+}
+
+// Parses the declarations in tokens and adds them to declarations.
+// Everything but functions is global and goes to the permanent arena.
+BOOL ParseFile(TokenArray* tokens, Declarations* declarations) {
+  TokenStream stream = { tokens->Tokens, tokens->TokensCount, 0 };
+  Parsed             = declarations;
 
   while (1) {
-    if (!stream) break;
     Token* tok = Pop(&stream);
     if (!tok) break;
 
-    switch (tok->TokenType) {
-      case TOK_FN: {
-        Fn* fn = ParseFn(&stream);
-        if (!fn) return FALSE;
-        Functions = Append(&Functions, fn);
-        break;
-      }
-
-      case TOK_EXTERN: {
-	if (!ParseExtern(&stream)) return FALSE;
-	break;
-      }
-
-      case TOK_CONST: {
-	if (!ParseConst(&stream)) return FALSE;
-	break;
-      }
+    BOOL is_inline = tok->TokenType == TOK_INLINE;
+    if (is_inline && !(tok = Expect(&stream, TOK_FN))) return FALSE;
 
-      case TOK_STATIC: {
-	Var* var = ParseVar(&stream, TRUE);
-	if (!var) return FALSE;
-	StaticVariables = Append(&StaticVariables, var);
-      }
+    if (tok->TokenType == TOK_FN) {
+      Fn* fn = ParseFn(&stream);
+      if (!fn) return FALSE;
+      fn->FnInline = is_inline;
+      Push(&declarations->DeclaredFunctions, fn);
+      continue;
     }
+
+    BOOL was_permanent = SetArenaPermanent(TRUE);
+    BOOL ok            = ParseGlobal(&stream, tok);
+    SetArenaPermanent(was_permanent);
+    if (!ok) return FALSE;
   }
 
   return TRUE;
@@ -0,0 +1,596 @@
+#include "Asm.h"
+
+// Peephole optimization of a function's legalized instructions, right before they're
+// printed or encoded. Every rule looks at one instruction and the few after it, and the
+// rules run over the function until none of them applies any more. Removed instructions
+// become OP_NONE until the end of the round.
+//
+// Which registers are live at labels is worked out at the start of every round. The
+// rules only ever remove reads or move them next to the instruction that was read,
+// so it stays an overestimate for the rest of the round. The rules rely on codegen
+// setting the flags right before the jump or SETcc that reads them.
+
+enum PeepholeRuleEnum {
+  PEEP_SELF_MOV,
+  PEEP_IDENTITY,
+  PEEP_COPY_PROPAGATION,
+  PEEP_RESULT_FORWARDING,
+  PEEP_TWO_OPERAND,
+  PEEP_STORE_TO_LOAD,
+  PEEP_REDUNDANT_MOV,
+  PEEP_DEAD_STORE,
+  PEEP_JUMP_THREADING,
+  PEEP_INVERTED_BRANCH,
+  PEEP_JUMP_TO_NEXT,
+  PEEP_UNREACHABLE,
+  PEEP_UNUSED_LABEL,
+
+  PEEPHOLE_RULE_COUNT,
+};
+typedef NUM PeepholeRule;
+
+static const char* PeepholeRuleNames[] = {
+  "self-mov",      "identity",      "copy-propagation", "result-forwarding", "two-operand",
+  "store-to-load", "redundant-mov", "dead-store",       "jump-threading",    "inverted-branch",
+  "jump-to-next",  "unreachable",   "unused-label",
+};
+
+// How often every rule applied over the whole program, added to atomically with -j
+static NUM PeepholeHits[PEEPHOLE_RULE_COUNT];
+
+// Jumps to a label through this many other jumps are threaded, longer chains are cycles
+static const NUM MAX_JUMP_CHAIN = 16;
+
+static const NUM ARGUMENTS_MASK = (1 << REG_RDI) | (1 << REG_RSI) | (1 << REG_RDX) | (1 << REG_RCX)
+                                | (1 << REG_R8) | (1 << REG_R9) | (1 << REG_R10);
+static const NUM CLOBBERED_MASK = ARGUMENTS_MASK | (1 << REG_RAX) | (1 << REG_R11);
+static const NUM PRESERVED_MASK = (1 << REG_RBX) | (1 << REG_RBP) | (1 << REG_RSP) | (1 << REG_R12)
+                                | (1 << REG_R13) | (1 << REG_R14) | (1 << REG_R15);
+
+/* clang-format off */
+static const Operator InvertedJumps[] = {
+  [OP_JZ] = OP_JNZ, [OP_JNZ] = OP_JZ, [OP_JL] = OP_JGE, [OP_JGE] = OP_JL, [OP_JLE] = OP_JG, [OP_JG] = OP_JLE,
+};
+/* clang-format on */
+
+// Where every label is, and how many jumps go to it, for the round being run
+static __thread NUM* LabelIndex;
+static __thread NUM* LabelRefs;
+static __thread NUM LabelCapacity;
+
+// The registers live before every instruction at the start of the round
+static __thread NUM* LiveIn;
+static __thread NUM LiveInCapacity;
+
+// The next instruction after i that's still there and isn't a comment, InstrsCount if none
+static NUM Next(InstrList* list, NUM i) {
+  for (i++; i < list->InstrsCount; i++) {
+    Operator op = list->Instrs[i].InstrOp;
+    if (op != OP_NONE && op != OP_COMMENT) break;
+  }
+  return i;
+}
+
+static void Remove(InstrList* list, NUM i) {
+  Instr* instr = &list->Instrs[i];
+  if (IS_JUMP(instr->InstrOp)) LabelRefs[instr->InstrLabel]--;
+  instr->InstrOp = OP_NONE;
+}
+
+static void SetJumpTarget(Instr* jump, NUM label) {
+  LabelRefs[jump->InstrLabel]--;
+  LabelRefs[label]++;
+  jump->InstrLabel = label;
+}
+
+static BOOL IsRegister(Location* loc, Register reg) {
+  return loc->LocationSpace == LOC_REGISTER && loc->LocationOffset == reg;
+}
+
+static BOOL IsMemory(Location* loc) {
+  NUM space = loc->LocationSpace;
+  return space == LOC_RBP_RELATIVE || space == LOC_RSP_RELATIVE || space == LOC_STATIC || space == LOC_EXTERN
+      || space == LOC_INDIRECT;
+}
+
+static BOOL SameLocation(Location* a, Location* b) {
+  return a->LocationSpace == b->LocationSpace && a->LocationOffset == b->LocationOffset
+      && a->LocationName == b->LocationName;
+}
+
+// The registers an operand reads as an address
+static NUM AddressRegisters(Location* loc) {
+  switch (loc->LocationSpace) {
+    case LOC_INDIRECT:
+    case LOC_SCALED: return 1 << loc->LocationOffset;
+    case LOC_RBP_RELATIVE: return 1 << REG_RBP;
+    case LOC_RSP_RELATIVE: return 1 << REG_RSP;
+  }
+  return 0;
+}
+
+static NUM ValueRegisters(Location* loc) {
+  return loc->LocationSpace == LOC_REGISTER ? 1 << loc->LocationOffset : AddressRegisters(loc);
+}
+
+static void GetRegisterUses(Instr* instr, NUM* reads, NUM* writes) {
+  BOOL dst_read, dst_written, src_read;
+  GetOperandRoles(instr, &dst_read, &dst_written, &src_read);
+
+  Location* dst = &instr->InstrDst;
+  *reads        = AddressRegisters(dst) | (src_read ? ValueRegisters(&instr->InstrSrc) : 0);
+  *writes       = 0;
+  if (dst->LocationSpace == LOC_REGISTER) {
+    if (dst_read) *reads |= 1 << dst->LocationOffset;
+    if (dst_written) *writes |= 1 << dst->LocationOffset;
+  }
+
+  switch (instr->InstrOp) {
+    case OP_XOR: {
+      // XOR r, r doesn't depend on r
+      if (SameLocation(dst, &instr->InstrSrc)) *reads &= ~*writes;
+      return;
+    }
+    case OP_IMUL_WIDE: {
+      *reads |= 1 << REG_RAX;
+      *writes |= (1 << REG_RAX) | (1 << REG_RDX);
+      return;
+    }
+    case OP_CQO: {
+      *reads |= 1 << REG_RAX;
+      *writes |= 1 << REG_RDX;
+      return;
+    }
+    case OP_IDIV: {
+      *reads |= (1 << REG_RAX) | (1 << REG_RDX);
+      *writes |= (1 << REG_RAX) | (1 << REG_RDX);
+      return;
+    }
+    case OP_PUSH:
+    case OP_POP: {
+      *reads |= 1 << REG_RSP;
+      *writes |= 1 << REG_RSP;
+      return;
+    }
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      // al is the number of vector arguments, only variadic C functions look at it
+      *reads |= ARGUMENTS_MASK | (1 << REG_RSP);
+      if (instr->InstrSrc.LocationSpace == LOC_EXTERN) *reads |= 1 << REG_RAX;
+      if (instr->InstrOp == OP_TAIL_CALL) *reads |= PRESERVED_MASK;
+      *writes |= CLOBBERED_MASK;
+      return;
+    }
+    case OP_RET: {
+      *reads |= ValueRegisters(&instr->InstrSrc) | PRESERVED_MASK;
+      return;
+    }
+  }
+}
+
+// Whether the value reg has after instruction i is never read. The instructions up to
+// the next label are looked at as they are now, past that it's up to LiveIn.
+static BOOL IsDeadAfter(InstrList* list, NUM i, Register reg) {
+  NUM mask = 1 << reg;
+  for (NUM j = Next(list, i); j < list->InstrsCount; j = Next(list, j)) {
+    Instr* instr = &list->Instrs[j];
+    if (instr->InstrOp == OP_LABEL) return !(LiveIn[j] & mask);
+    if (IS_JUMP(instr->InstrOp)) {
+      if (LiveIn[LabelIndex[instr->InstrLabel]] & mask) return FALSE;
+      if (instr->InstrOp == OP_JMP) return TRUE;
+      continue;
+    }
+
+    NUM reads, writes;
+    GetRegisterUses(instr, &reads, &writes);
+    if (reads & mask) return FALSE;
+    if (writes & mask) return TRUE;
+    if (instr->InstrOp == OP_RET || instr->InstrOp == OP_TAIL_CALL) return TRUE;
+  }
+  return TRUE;
+}
+
+// Whether the flags after instruction i are set again before anything reads them
+static BOOL FlagsDeadAfter(InstrList* list, NUM i) {
+  for (NUM j = Next(list, i); j < list->InstrsCount; j = Next(list, j)) {
+    Operator op = list->Instrs[j].InstrOp;
+    if ((IS_JUMP(op) && op != OP_JMP) || (op >= OP_LT && op <= OP_NE)) return FALSE;
+    if (op == OP_CMP || op == OP_TEST || op == OP_ADD || op == OP_SUB || op == OP_BAND || op == OP_BOR
+        || op == OP_XOR)
+      return TRUE;
+    if (op == OP_LABEL || op == OP_JMP || op == OP_CALL || op == OP_TAIL_CALL || op == OP_RET) return TRUE;
+  }
+  return TRUE;
+}
+
+// Whether the labels right after instruction i include label
+static BOOL FallsThroughTo(InstrList* list, NUM i, NUM label) {
+  NUM j = Next(list, i);
+  while (j < list->InstrsCount && list->Instrs[j].InstrOp == OP_LABEL) {
+    if (list->Instrs[j].InstrLabel == label) return TRUE;
+    j = Next(list, j);
+  }
+  return FALSE;
+}
+
+// The first instruction after label that isn't a label, NULL at the end of the function
+static Instr* FirstAfterLabel(InstrList* list, NUM label) {
+  NUM j = LabelIndex[label];
+  while (j < list->InstrsCount && list->Instrs[j].InstrOp == OP_LABEL)
+    j = Next(list, j);
+  return j < list->InstrsCount ? &list->Instrs[j] : NULL;
+}
+
+// MOV r, r
+static BOOL RemoveSelfMove(InstrList* list, NUM i) {
+  Instr* instr = &list->Instrs[i];
+  if (instr->InstrOp != OP_MOV || instr->InstrDst.LocationSpace != LOC_REGISTER
+      || !SameLocation(&instr->InstrDst, &instr->InstrSrc))
+    return FALSE;
+
+  Remove(list, i);
+  return TRUE;
+}
+
+// ADD, SUB, OR, XOR or a shift of 0 whose flags aren't used
+static BOOL RemoveIdentity(InstrList* list, NUM i) {
+  Instr* instr = &list->Instrs[i];
+  Operator op  = instr->InstrOp;
+  if (op != OP_ADD && op != OP_SUB && op != OP_BOR && op != OP_XOR && op != OP_SHL && op != OP_SAR
+      && op != OP_SHR)
+    return FALSE;
+  if (instr->InstrSrc.LocationSpace != LOC_CONSTANT || instr->InstrSrc.LocationOffset != 0) return FALSE;
+  if (!FlagsDeadAfter(list, i)) return FALSE;
+
+  Remove(list, i);
+  return TRUE;
+}
+
+static void ReplaceRegister(Location* loc, Register from, Register to) {
+  NUM space = loc->LocationSpace;
+  if ((space == LOC_REGISTER || space == LOC_INDIRECT || space == LOC_SCALED) && loc->LocationOffset == from)
+    loc->LocationOffset = to;
+}
+
+// MOV t, x followed by an instruction that reads t: it reads x instead, and the MOV goes
+// as long as t isn't read after that. Mostly addresses and stored values going through
+// r11 and rax.
+static BOOL PropagateCopy(InstrList* list, NUM i) {
+  Instr* copy = &list->Instrs[i];
+  if (copy->InstrOp != OP_MOV || copy->InstrDst.LocationSpace != LOC_REGISTER
+      || copy->InstrSrc.LocationSpace != LOC_REGISTER)
+    return FALSE;
+
+  Register t = copy->InstrDst.LocationOffset;
+  Register x = copy->InstrSrc.LocationOffset;
+  if (t == REG_RSP || t == REG_RBP || x == REG_RSP || x == REG_RBP) return FALSE;
+
+  NUM j = Next(list, i);
+  if (j == list->InstrsCount) return FALSE;
+
+  Instr changed = list->Instrs[j];
+  Operator op   = changed.InstrOp;
+  // Not shifts, their count has to stay in cl
+  if (op != OP_MOV && op != OP_MOV8 && op != OP_MOVZX8 && op != OP_LEA && op != OP_ADD && op != OP_SUB
+      && op != OP_IMUL && op != OP_BAND && op != OP_BOR && op != OP_XOR && op != OP_TEST && op != OP_CMP)
+    return FALSE;
+
+  BOOL dst_read, dst_written, src_read;
+  GetOperandRoles(&changed, &dst_read, &dst_written, &src_read);
+  if (src_read) ReplaceRegister(&changed.InstrSrc, t, x);
+  if (changed.InstrDst.LocationSpace == LOC_INDIRECT || !dst_written)
+    ReplaceRegister(&changed.InstrDst, t, x);
+
+  NUM reads, writes;
+  GetRegisterUses(&changed, &reads, &writes);
+  if (reads & (1 << t)) return FALSE;
+  if (!(writes & (1 << t)) && !IsDeadAfter(list, j, t)) return FALSE;
+
+  list->Instrs[j] = changed;
+  Remove(list, i);
+  return TRUE;
+}
+
+// A load into t followed by MOV r, t: loads into r instead, as long as t isn't read after
+static BOOL ForwardResult(InstrList* list, NUM i) {
+  Instr* load = &list->Instrs[i];
+  Operator op = load->InstrOp;
+  if ((op != OP_MOV && op != OP_MOVZX8 && op != OP_LEA) || load->InstrDst.LocationSpace != LOC_REGISTER)
+    return FALSE;
+
+  NUM j = Next(list, i);
+  if (j == list->InstrsCount) return FALSE;
+
+  Instr* copy = &list->Instrs[j];
+  Register t  = load->InstrDst.LocationOffset;
+  if (copy->InstrOp != OP_MOV || copy->InstrDst.LocationSpace != LOC_REGISTER
+      || !IsRegister(&copy->InstrSrc, t))
+    return FALSE;
+  if (IsRegister(&copy->InstrDst, REG_RSP) || IsRegister(&copy->InstrDst, REG_RBP)
+      || !IsDeadAfter(list, j, t))
+    return FALSE;
+
+  load->InstrDst = copy->InstrDst;
+  Remove(list, j);
+  return TRUE;
+}
+
+// MOV t, x, then an operation on t, then MOV x, t: the operation is done on x, as long as
+// t isn't read after that
+static BOOL UseTwoOperands(InstrList* list, NUM i) {
+  Instr* copy = &list->Instrs[i];
+  if (copy->InstrOp != OP_MOV || copy->InstrDst.LocationSpace != LOC_REGISTER
+      || copy->InstrSrc.LocationSpace != LOC_REGISTER)
+    return FALSE;
+
+  Register t = copy->InstrDst.LocationOffset;
+  Register x = copy->InstrSrc.LocationOffset;
+  NUM j      = Next(list, i);
+  NUM k      = j < list->InstrsCount ? Next(list, j) : j;
+  if (k == list->InstrsCount || t == x) return FALSE;
+
+  Instr* operation = &list->Instrs[j];
+  Instr* back      = &list->Instrs[k];
+  Operator op      = operation->InstrOp;
+  BOOL is_shift    = op == OP_SHL || op == OP_SAR || op == OP_SHR;
+  if (op != OP_ADD && op != OP_SUB && op != OP_IMUL && op != OP_BAND && op != OP_BOR && op != OP_XOR
+      && !is_shift)
+    return FALSE;
+  // A shift count in t would have to move out of cl
+  if (is_shift && IsRegister(&operation->InstrSrc, t)) return FALSE;
+  if (!IsRegister(&operation->InstrDst, t) || back->InstrOp != OP_MOV || !IsRegister(&back->InstrDst, x)
+      || !IsRegister(&back->InstrSrc, t) || !IsDeadAfter(list, k, t))
+    return FALSE;
+
+  // t still holds x when the operation reads it
+  operation->InstrDst.LocationOffset = x;
+  ReplaceRegister(&operation->InstrSrc, t, x);
+  Remove(list, i);
+  Remove(list, k);
+  return TRUE;
+}
+
+// MOV m, r followed by an instruction that reads m: it reads r instead. Mostly spill slots.
+static BOOL ForwardStore(InstrList* list, NUM i) {
+  Instr* store = &list->Instrs[i];
+  if (store->InstrOp != OP_MOV || !IsMemory(&store->InstrDst)
+      || store->InstrSrc.LocationSpace != LOC_REGISTER)
+    return FALSE;
+
+  NUM j = Next(list, i);
+  if (j == list->InstrsCount) return FALSE;
+
+  // Byte operands can't take a 64 bit register
+  Instr* instr = &list->Instrs[j];
+  Operator op  = instr->InstrOp;
+  if (op != OP_MOV && op != OP_ADD && op != OP_SUB && op != OP_IMUL && op != OP_BAND && op != OP_BOR
+      && op != OP_XOR && op != OP_TEST && op != OP_CMP)
+    return FALSE;
+  if (!SameLocation(&instr->InstrSrc, &store->InstrDst)) return FALSE;
+
+  instr->InstrSrc = store->InstrSrc;
+  return TRUE;
+}
+
+// MOV a, b followed by MOV b, a
+static BOOL RemoveRedundantMove(InstrList* list, NUM i) {
+  Instr* first = &list->Instrs[i];
+  if (first->InstrOp != OP_MOV) return FALSE;
+
+  NUM j = Next(list, i);
+  if (j == list->InstrsCount) return FALSE;
+
+  Instr* second = &list->Instrs[j];
+  if (second->InstrOp != OP_MOV || !SameLocation(&second->InstrDst, &first->InstrSrc)
+      || !SameLocation(&second->InstrSrc, &first->InstrDst))
+    return FALSE;
+
+  // MOV r, [r] changes where [r] is
+  if (first->InstrDst.LocationSpace == LOC_REGISTER
+      && (AddressRegisters(&first->InstrSrc) & (1 << first->InstrDst.LocationOffset)))
+    return FALSE;
+
+  Remove(list, j);
+  return TRUE;
+}
+
+// A register written and never read, or memory written again right away. The XOR of rax
+// before calls to k functions goes this way.
+static BOOL RemoveDeadStore(InstrList* list, NUM i) {
+  Instr* instr  = &list->Instrs[i];
+  Operator op   = instr->InstrOp;
+  Location* dst = &instr->InstrDst;
+
+  if (op == OP_MOV && IsMemory(dst)) {
+    NUM j = Next(list, i);
+    if (j == list->InstrsCount) return FALSE;
+
+    Instr* next = &list->Instrs[j];
+    if (next->InstrOp != OP_MOV || !SameLocation(&next->InstrDst, dst) || SameLocation(&next->InstrSrc, dst))
+      return FALSE;
+
+    Remove(list, i);
+    return TRUE;
+  }
+
+  BOOL zeroing = op == OP_XOR && SameLocation(dst, &instr->InstrSrc);
+  if (op != OP_MOV && op != OP_MOVZX8 && op != OP_LEA && !zeroing) return FALSE;
+  if (dst->LocationSpace != LOC_REGISTER || IsRegister(dst, REG_RSP) || IsRegister(dst, REG_RBP))
+    return FALSE;
+  if (zeroing && !FlagsDeadAfter(list, i)) return FALSE;
+  if (!IsDeadAfter(list, i, dst->LocationOffset)) return FALSE;
+
+  Remove(list, i);
+  return TRUE;
+}
+
+// A jump to a jump goes straight to where the second one goes
+static BOOL ThreadJump(InstrList* list, NUM i) {
+  Instr* jump = &list->Instrs[i];
+  if (!IS_JUMP(jump->InstrOp)) return FALSE;
+
+  NUM target = jump->InstrLabel;
+  for (NUM hops = 0; hops < MAX_JUMP_CHAIN; hops++) {
+    Instr* first = FirstAfterLabel(list, target);
+    if (!first || first->InstrOp != OP_JMP || first->InstrLabel == target) break;
+    target = first->InstrLabel;
+  }
+
+  Instr* first = FirstAfterLabel(list, target);
+  if (target == jump->InstrLabel) return FALSE;
+  if (first && first->InstrOp == OP_JMP && first->InstrLabel != target) return FALSE;
+
+  SetJumpTarget(jump, target);
+  return TRUE;
+}
+
+// Jcc a, JMP b, a: becomes the opposite Jcc b
+static BOOL InvertBranch(InstrList* list, NUM i) {
+  Instr* branch = &list->Instrs[i];
+  if (!IS_JUMP(branch->InstrOp) || branch->InstrOp == OP_JMP) return FALSE;
+
+  NUM j = Next(list, i);
+  if (j == list->InstrsCount || list->Instrs[j].InstrOp != OP_JMP) return FALSE;
+  if (!FallsThroughTo(list, j, branch->InstrLabel)) return FALSE;
+
+  branch->InstrOp = InvertedJumps[branch->InstrOp];
+  SetJumpTarget(branch, list->Instrs[j].InstrLabel);
+  Remove(list, j);
+  return TRUE;
+}
+
+static BOOL RemoveJumpToNext(InstrList* list, NUM i) {
+  Instr* jump = &list->Instrs[i];
+  if (!IS_JUMP(jump->InstrOp) || !FallsThroughTo(list, i, jump->InstrLabel)) return FALSE;
+
+  Remove(list, i);
+  return TRUE;
+}
+
+// Everything between a JMP or a return and the next label
+static BOOL RemoveUnreachable(InstrList* list, NUM i) {
+  Operator op = list->Instrs[i].InstrOp;
+  if (op != OP_JMP && op != OP_RET && op != OP_TAIL_CALL) return FALSE;
+
+  BOOL removed = FALSE;
+  for (NUM j = i + 1; j < list->InstrsCount && list->Instrs[j].InstrOp != OP_LABEL; j++) {
+    if (list->Instrs[j].InstrOp == OP_NONE) continue;
+    Remove(list, j);
+    removed = TRUE;
+  }
+  return removed;
+}
+
+static BOOL RemoveUnusedLabel(InstrList* list, NUM i) {
+  Instr* label = &list->Instrs[i];
+  if (label->InstrOp != OP_LABEL || LabelRefs[label->InstrLabel] > 0) return FALSE;
+
+  Remove(list, i);
+  return TRUE;
+}
+
+static BOOL (*const PeepholeRules[PEEPHOLE_RULE_COUNT])(InstrList* list, NUM i) = {
+  [PEEP_SELF_MOV] = RemoveSelfMove,
+  [PEEP_IDENTITY] = RemoveIdentity,
+  [PEEP_COPY_PROPAGATION] = PropagateCopy,
+  [PEEP_RESULT_FORWARDING] = ForwardResult,
+  [PEEP_TWO_OPERAND] = UseTwoOperands,
+  [PEEP_STORE_TO_LOAD] = ForwardStore,
+  [PEEP_REDUNDANT_MOV] = RemoveRedundantMove,
+  [PEEP_DEAD_STORE] = RemoveDeadStore,
+  [PEEP_JUMP_THREADING] = ThreadJump,
+  [PEEP_INVERTED_BRANCH] = InvertBranch,
+  [PEEP_JUMP_TO_NEXT] = RemoveJumpToNext,
+  [PEEP_UNREACHABLE] = RemoveUnreachable,
+  [PEEP_UNUSED_LABEL] = RemoveUnusedLabel,
+};
+
+static void IndexLabels(InstrList* list) {
+  NUM label_count = 0;
+  for (NUM i = 0; i < list->InstrsCount; i++) {
+    Instr* instr = &list->Instrs[i];
+    if ((instr->InstrOp == OP_LABEL || IS_JUMP(instr->InstrOp)) && instr->InstrLabel >= label_count)
+      label_count = instr->InstrLabel + 1;
+  }
+
+  if (label_count > LabelCapacity) {
+    LabelCapacity = label_count;
+    LabelIndex    = realloc(LabelIndex, LabelCapacity * sizeof(NUM));
+    LabelRefs     = realloc(LabelRefs, LabelCapacity * sizeof(NUM));
+  }
+  if (label_count) memset(LabelRefs, 0, label_count * sizeof(NUM));
+
+  for (NUM i = 0; i < list->InstrsCount; i++) {
+    Instr* instr = &list->Instrs[i];
+    if (instr->InstrOp == OP_LABEL) LabelIndex[instr->InstrLabel] = i;
+    if (IS_JUMP(instr->InstrOp)) LabelRefs[instr->InstrLabel]++;
+  }
+}
+
+// Backwards over the function until nothing changes, loops take more than one pass
+static void ComputeLiveness(InstrList* list) {
+  if (list->InstrsCount > LiveInCapacity) {
+    LiveInCapacity = list->InstrsCount;
+    LiveIn         = realloc(LiveIn, LiveInCapacity * sizeof(NUM));
+  }
+  memset(LiveIn, 0, list->InstrsCount * sizeof(NUM));
+
+  BOOL changed = TRUE;
+  while (changed) {
+    changed = FALSE;
+
+    for (NUM i = list->InstrsCount - 1; i >= 0; i--) {
+      Instr* instr = &list->Instrs[i];
+      Operator op  = instr->InstrOp;
+
+      NUM live_out = 0;
+      if (op != OP_JMP && op != OP_RET && op != OP_TAIL_CALL && i + 1 < list->InstrsCount)
+        live_out = LiveIn[i + 1];
+      if (IS_JUMP(op)) live_out |= LiveIn[LabelIndex[instr->InstrLabel]];
+
+      NUM reads, writes;
+      GetRegisterUses(instr, &reads, &writes);
+      NUM live_in = (live_out & ~writes) | reads;
+      if (live_in != LiveIn[i]) {
+        LiveIn[i] = live_in;
+        changed   = TRUE;
+      }
+    }
+  }
+}
+
+void OptimizePeephole(InstrList* list) {
+  NUM hits[PEEPHOLE_RULE_COUNT] = { 0 };
+
+  BOOL changed = TRUE;
+  while (changed) {
+    changed = FALSE;
+    IndexLabels(list);
+    ComputeLiveness(list);
+
+    for (NUM i = 0; i < list->InstrsCount; i++) {
+      for (PeepholeRule rule = 0; rule < PEEPHOLE_RULE_COUNT; rule++) {
+        Operator op = list->Instrs[i].InstrOp;
+        if (op == OP_NONE || op == OP_COMMENT) break;
+        if (!PeepholeRules[rule](list, i)) continue;
+        hits[rule]++;
+        changed = TRUE;
+      }
+    }
+
+    NUM count = 0;
+    for (NUM i = 0; i < list->InstrsCount; i++) {
+      if (list->Instrs[i].InstrOp != OP_NONE) list->Instrs[count++] = list->Instrs[i];
+    }
+    list->InstrsCount = count;
+  }
+
+  for (PeepholeRule rule = 0; rule < PEEPHOLE_RULE_COUNT; rule++) {
+    if (hits[rule]) __atomic_fetch_add(&PeepholeHits[rule], hits[rule], __ATOMIC_RELAXED);
+  }
+}
+
+void PrintPeepholeStats() {
+  for (PeepholeRule rule = 0; rule < PEEPHOLE_RULE_COUNT; rule++)
+    fprintf(stderr, "%-18s %8ld hits\n", PeepholeRuleNames[rule], PeepholeHits[rule]);
+}
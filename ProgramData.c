@@ -1,8 +1,26 @@
 #include "Common.h"
 #include "ProgramData.h"
+#include "Node.h"
 
-Cons* Strings = NULL;
-Cons* Externs = NULL;
-Cons* Functions = NULL;
-Cons* Consts = NULL;
-Cons* StaticVariables = NULL;
+ConsList Strings         = { NULL };
+ConsList Externs         = { NULL };
+ConsList Functions       = { NULL };
+ConsList Consts          = { NULL };
+ConsList StaticVariables = { NULL };
+
+static NUM NextStringLabel;
+
+void MergeDeclarations(Declarations* declarations) {
+  Cons* str = declarations->DeclaredStrings.ListHead;
+  while (str) {
+    ((String*)str->Value)->StringLabel = NextStringLabel++;
+    str = str->Tail;
+  }
+
+  Concat(&Strings, &declarations->DeclaredStrings);
+  Concat(&Externs, &declarations->DeclaredExterns);
+  Concat(&Functions, &declarations->DeclaredFunctions);
+  Concat(&Consts, &declarations->DeclaredConsts);
+  Concat(&StaticVariables, &declarations->DeclaredStatics);
+  memset(declarations, 0, sizeof(Declarations));
+}
@@ -8,8 +8,21 @@ typedef struct Const {
   NUM ConstValue;
 } Const;
 
-extern Cons* Strings;
-extern Cons* Externs;
-extern Cons* Functions;
-extern Cons* Consts;
-extern Cons* StaticVariables;
+extern ConsList Strings;
+extern ConsList Externs;
+extern ConsList Functions;
+extern ConsList Consts;
+extern ConsList StaticVariables;
+
+// What ParseFile found in some declarations, before it's added to the lists above
+typedef struct Declarations {
+  ConsList DeclaredStrings;
+  ConsList DeclaredExterns;
+  ConsList DeclaredFunctions;
+  ConsList DeclaredConsts;
+  ConsList DeclaredStatics;
+} Declarations;
+
+// Moves the declarations to the end of the program's lists and labels their strings.
+// Merging files in command line order gives the same program however they were parsed.
+void MergeDeclarations(Declarations* declarations);
@@ -0,0 +1,338 @@
+#include "Asm.h"
+
+// Linear-scan register allocation over the virtual registers of one function.
+//
+// Instruction i reads its operands at position 2i and writes at 2i + 1. A virtual register
+// occupies one physical register from its first to its last position. Codegen also uses some
+// physical registers directly (argument registers on entry and around calls, and everything a
+// call clobbers); those uses are collected as fixed ranges, and a virtual register never gets
+// a register that has a fixed range overlapping its own interval.
+//
+// rax, rdx and r11 are scratch registers for codegen and are never handed out.
+
+static const Register AllocatableRegisters[] = {
+  REG_RCX, REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10, REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15,
+};
+static const NUM ALLOCATABLE_COUNT = sizeof(AllocatableRegisters) / sizeof(AllocatableRegisters[0]);
+
+static const NUM CALLER_SAVED_MASK = (1 << REG_RCX) | (1 << REG_RSI) | (1 << REG_RDI) | (1 << REG_R8)
+                                   | (1 << REG_R9) | (1 << REG_R10);
+static const NUM CALLEE_SAVED_MASK = (1 << REG_RBX) | (1 << REG_R12) | (1 << REG_R13) | (1 << REG_R14)
+                                   | (1 << REG_R15);
+
+typedef struct Interval {
+  NUM IntervalVReg;
+  NUM IntervalStart;
+  NUM IntervalEnd;
+  Register IntervalRegister; // -1 while unassigned or spilled
+  Register IntervalHint;     // the register it's first copied from, tried first, -1 if none
+} Interval;
+
+static BOOL IsAllocatable(Location* loc) {
+  return loc->LocationSpace == LOC_REGISTER
+      && ((1 << loc->LocationOffset) & (CALLER_SAVED_MASK | CALLEE_SAVED_MASK));
+}
+
+void GetOperandRoles(Instr* instr, BOOL* dst_read, BOOL* dst_written, BOOL* src_read) {
+  *dst_read    = FALSE;
+  *dst_written = FALSE;
+  *src_read    = FALSE;
+
+  switch (instr->InstrOp) {
+    case OP_MOV:
+    case OP_MOVZX8:
+    case OP_LEA:
+    case OP_POP: *dst_written = TRUE; *src_read = TRUE; return;
+
+    case OP_MOV8:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_BAND:
+    case OP_BOR:
+    case OP_XOR:
+    case OP_IMUL:
+    case OP_SHL:
+    case OP_SAR:
+    case OP_SHR: *dst_read = TRUE; *dst_written = TRUE; *src_read = TRUE; return;
+
+    case OP_TEST:
+    case OP_CMP: *dst_read = TRUE; *src_read = TRUE; return;
+
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_EQ:
+    case OP_NE: *dst_read = TRUE; *dst_written = TRUE; return;
+
+    case OP_PUSH:
+    case OP_IMUL_WIDE:
+    case OP_IDIV: *src_read = TRUE; return;
+  }
+}
+
+static void Touch(Interval* intervals, Location* loc, NUM position) {
+  if (loc->LocationSpace != LOC_VREG) return;
+
+  Interval* interval = &intervals[loc->LocationOffset];
+  if (interval->IntervalStart < 0) interval->IntervalStart = position;
+  interval->IntervalEnd = position;
+}
+
+static void AddFixedRange(NUM* fixed, Register reg, NUM from, NUM to) {
+  for (NUM position = from; position <= to; position++)
+    fixed[position] |= 1 << reg;
+}
+
+// Physical registers written by one instruction and read by a later one, or clobbered by a call
+static void CollectFixedRanges(InstrList* list, NUM* fixed) {
+  NUM live_since[REG_COUNT];
+  BOOL written[REG_COUNT];
+  for (NUM reg = 0; reg < REG_COUNT; reg++) {
+    live_since[reg] = 0; // live-in, i.e. incoming arguments
+    written[reg]    = FALSE;
+  }
+
+  for (NUM i = 0; i < list->InstrsCount; i++) {
+    Instr* instr = &list->Instrs[i];
+
+    if (instr->InstrOp == OP_CALL || instr->InstrOp == OP_TAIL_CALL) {
+      for (NUM reg = 0; reg < REG_COUNT; reg++) {
+        if (!((1 << reg) & CALLER_SAVED_MASK)) continue;
+        // Arguments are read by the call, everything else is clobbered by it
+        if (written[reg]) AddFixedRange(fixed, reg, live_since[reg], 2 * i);
+        AddFixedRange(fixed, reg, 2 * i + 1, 2 * i + 1);
+        live_since[reg] = -1;
+        written[reg]    = FALSE;
+      }
+      continue;
+    }
+
+    BOOL dst_read, dst_written, src_read;
+    GetOperandRoles(instr, &dst_read, &dst_written, &src_read);
+
+    if (src_read && IsAllocatable(&instr->InstrSrc)) {
+      Register reg = instr->InstrSrc.LocationOffset;
+      if (live_since[reg] >= 0) AddFixedRange(fixed, reg, live_since[reg], 2 * i);
+      live_since[reg] = 2 * i;
+    }
+    if (dst_read && IsAllocatable(&instr->InstrDst)) {
+      Register reg = instr->InstrDst.LocationOffset;
+      if (live_since[reg] >= 0) AddFixedRange(fixed, reg, live_since[reg], 2 * i);
+      live_since[reg] = 2 * i;
+    }
+    if (dst_written && IsAllocatable(&instr->InstrDst)) {
+      live_since[instr->InstrDst.LocationOffset] = 2 * i + 1;
+      written[instr->InstrDst.LocationOffset]    = TRUE;
+    }
+  }
+}
+
+// A variable can be read on one iteration of a loop and written on the previous one, so a
+// variable that is used anywhere inside a loop is kept alive across the whole loop.
+static void ExtendOverLoops(InstrList* list, Interval* intervals, NUM vreg_count, BOOL* vreg_is_variable) {
+  NUM min_label = -1;
+  NUM max_label = -1;
+  for (NUM i = 0; i < list->InstrsCount; i++) {
+    if (list->Instrs[i].InstrOp != OP_LABEL) continue;
+    NUM label = list->Instrs[i].InstrLabel;
+    if (min_label < 0 || label < min_label) min_label = label;
+    if (label > max_label) max_label = label;
+  }
+  if (min_label < 0) return;
+
+  NUM* label_index = malloc((max_label - min_label + 1) * sizeof(NUM));
+  for (NUM i = 0; i < list->InstrsCount; i++) {
+    if (list->Instrs[i].InstrOp == OP_LABEL) label_index[list->Instrs[i].InstrLabel - min_label] = i;
+  }
+
+  BOOL changed = TRUE;
+  while (changed) {
+    changed = FALSE;
+
+    for (NUM i = 0; i < list->InstrsCount; i++) {
+      Instr* instr = &list->Instrs[i];
+      if (!IS_JUMP(instr->InstrOp)) continue;
+
+      NUM target = label_index[instr->InstrLabel - min_label];
+      if (target > i) continue;
+
+      NUM loop_start = 2 * target;
+      NUM loop_end   = 2 * i + 1;
+
+      for (NUM vreg = 0; vreg < vreg_count; vreg++) {
+        Interval* interval = &intervals[vreg];
+        if (!vreg_is_variable[vreg] || interval->IntervalStart < 0) continue;
+        if (interval->IntervalEnd < loop_start || interval->IntervalStart > loop_end) continue;
+
+        if (interval->IntervalStart > loop_start) {
+          interval->IntervalStart = loop_start;
+          changed                 = TRUE;
+        }
+        if (interval->IntervalEnd < loop_end) {
+          interval->IntervalEnd = loop_end;
+          changed               = TRUE;
+        }
+      }
+    }
+  }
+
+  free(label_index);
+}
+
+typedef struct SpillSlot {
+  NUM SpillOffset;
+  NUM SpillEnd; // end of the last interval spilled to this slot
+} SpillSlot;
+
+// Spill slots are reused once the interval in them is dead. Intervals assigned to one slot
+// never overlap, so checking the last occupant is enough.
+static NUM AssignSpillSlot(Interval* interval, SpillSlot* slots, NUM* slots_count, NUM* stack_offset) {
+  for (NUM i = 0; i < *slots_count; i++) {
+    if (slots[i].SpillEnd < interval->IntervalStart) {
+      slots[i].SpillEnd = interval->IntervalEnd;
+      return slots[i].SpillOffset;
+    }
+  }
+
+  *stack_offset -= 8;
+  slots[*slots_count].SpillOffset = *stack_offset;
+  slots[*slots_count].SpillEnd    = interval->IntervalEnd;
+  (*slots_count)++;
+  return *stack_offset;
+}
+
+static int CompareStart(const void* a, const void* b) {
+  const Interval* lhs = *(const Interval**)a;
+  const Interval* rhs = *(const Interval**)b;
+  if (lhs->IntervalStart != rhs->IntervalStart) return lhs->IntervalStart < rhs->IntervalStart ? -1 : 1;
+  return lhs->IntervalVReg < rhs->IntervalVReg ? -1 : 1;
+}
+
+static void Substitute(Location* loc, Interval* intervals, NUM* spill_offsets) {
+  if (loc->LocationSpace != LOC_VREG) return;
+
+  NUM vreg = loc->LocationOffset;
+  if (intervals[vreg].IntervalRegister >= 0) {
+    loc->LocationSpace  = LOC_REGISTER;
+    loc->LocationOffset = intervals[vreg].IntervalRegister;
+  } else {
+    loc->LocationSpace  = LOC_RBP_RELATIVE;
+    loc->LocationOffset = spill_offsets[vreg];
+  }
+}
+
+// Rewrites every LOC_VREG operand into a register or an rbp-relative spill slot below
+// stack_offset, sharing slots between intervals that don't overlap. Returns the lowest
+// stack offset in use afterwards, and sets saved_registers to the mask of callee-saved
+// registers that were handed out.
+NUM AllocateRegisters(InstrList* list, NUM vreg_count, BOOL* vreg_is_variable, NUM stack_offset,
+                      NUM* saved_registers) {
+  *saved_registers = 0;
+  if (vreg_count == 0) return stack_offset;
+
+  Interval* intervals = malloc(vreg_count * sizeof(Interval));
+  for (NUM vreg = 0; vreg < vreg_count; vreg++) {
+    intervals[vreg].IntervalVReg     = vreg;
+    intervals[vreg].IntervalStart    = -1;
+    intervals[vreg].IntervalEnd      = -1;
+    intervals[vreg].IntervalRegister = -1;
+    intervals[vreg].IntervalHint     = -1;
+  }
+
+  for (NUM i = 0; i < list->InstrsCount; i++) {
+    Instr* instr = &list->Instrs[i];
+    BOOL dst_read, dst_written, src_read;
+    GetOperandRoles(instr, &dst_read, &dst_written, &src_read);
+
+    // Params are copied out of the argument registers, and can often stay in them
+    if (instr->InstrOp == OP_MOV && instr->InstrDst.LocationSpace == LOC_VREG
+        && IsAllocatable(&instr->InstrSrc) && intervals[instr->InstrDst.LocationOffset].IntervalStart < 0)
+      intervals[instr->InstrDst.LocationOffset].IntervalHint = instr->InstrSrc.LocationOffset;
+
+    if (src_read) Touch(intervals, &instr->InstrSrc, 2 * i);
+    if (dst_read) Touch(intervals, &instr->InstrDst, 2 * i);
+    if (dst_written) Touch(intervals, &instr->InstrDst, 2 * i + 1);
+  }
+
+  ExtendOverLoops(list, intervals, vreg_count, vreg_is_variable);
+
+  NUM* fixed = calloc(2 * list->InstrsCount + 2, sizeof(NUM));
+  CollectFixedRanges(list, fixed);
+
+  Interval** sorted = malloc(vreg_count * sizeof(Interval*));
+  NUM sorted_count  = 0;
+  for (NUM vreg = 0; vreg < vreg_count; vreg++) {
+    if (intervals[vreg].IntervalStart >= 0) sorted[sorted_count++] = &intervals[vreg];
+  }
+  qsort(sorted, sorted_count, sizeof(Interval*), CompareStart);
+
+  Interval* active[ALLOCATABLE_COUNT];
+  NUM active_count = 0;
+  NUM* spill_offsets = malloc(vreg_count * sizeof(NUM));
+  SpillSlot* spill_slots = malloc(vreg_count * sizeof(SpillSlot));
+  NUM spill_slots_count  = 0;
+
+  for (NUM i = 0; i < sorted_count; i++) {
+    Interval* current = sorted[i];
+
+    // Expire intervals that ended before this one starts
+    NUM kept = 0;
+    for (NUM j = 0; j < active_count; j++) {
+      if (active[j]->IntervalEnd >= current->IntervalStart) active[kept++] = active[j];
+    }
+    active_count = kept;
+
+    NUM fixed_overlap = 0;
+    for (NUM position = current->IntervalStart; position <= current->IntervalEnd; position++)
+      fixed_overlap |= fixed[position];
+
+    NUM forbidden = fixed_overlap;
+    for (NUM j = 0; j < active_count; j++)
+      forbidden |= 1 << active[j]->IntervalRegister;
+
+    if (current->IntervalHint >= 0 && !((1 << current->IntervalHint) & forbidden))
+      current->IntervalRegister = current->IntervalHint;
+
+    for (NUM j = 0; j < ALLOCATABLE_COUNT && current->IntervalRegister < 0; j++) {
+      if (!((1 << AllocatableRegisters[j]) & forbidden)) {
+        current->IntervalRegister = AllocatableRegisters[j];
+        break;
+      }
+    }
+
+    if (current->IntervalRegister < 0) {
+      // Out of registers: spill whichever interval ends last
+      NUM victim = -1;
+      for (NUM j = 0; j < active_count; j++) {
+        if ((1 << active[j]->IntervalRegister) & fixed_overlap) continue;
+        if (active[j]->IntervalEnd <= current->IntervalEnd) continue;
+        if (victim < 0 || active[j]->IntervalEnd > active[victim]->IntervalEnd) victim = j;
+      }
+
+      Interval* spilled = victim >= 0 ? active[victim] : current;
+      spill_offsets[spilled->IntervalVReg] = AssignSpillSlot(spilled, spill_slots, &spill_slots_count,
+                                                             &stack_offset);
+
+      if (victim < 0) continue;
+      current->IntervalRegister = active[victim]->IntervalRegister;
+      active[victim]->IntervalRegister = -1;
+      active[victim] = active[--active_count];
+    }
+
+    if ((1 << current->IntervalRegister) & CALLEE_SAVED_MASK) *saved_registers |= 1 << current->IntervalRegister;
+    active[active_count++] = current;
+  }
+
+  for (NUM i = 0; i < list->InstrsCount; i++) {
+    Substitute(&list->Instrs[i].InstrDst, intervals, spill_offsets);
+    Substitute(&list->Instrs[i].InstrSrc, intervals, spill_offsets);
+  }
+
+  free(spill_slots);
+  free(spill_offsets);
+  free(sorted);
+  free(fixed);
+  free(intervals);
+  return stack_offset;
+}
@@ -0,0 +1,55 @@
+#include "Table.h"
+
+static NUM HashName(const char* key) {
+  uint64_t hash = (uint64_t)key * 11400714819323198485u;
+  return (NUM)(hash >> 32);
+}
+
+static TableEntry* FindEntry(TableEntry* entries, NUM capacity, const char* key) {
+  NUM mask  = capacity - 1;
+  NUM index = HashName(key) & mask;
+
+  while (1) {
+    TableEntry* entry = &entries[index];
+    if (!entry->EntryKey || entry->EntryKey == key) return entry;
+    index = (index + 1) & mask;
+  }
+}
+
+static void Grow(Table* table) {
+  NUM capacity        = table->TableCapacity ? table->TableCapacity * 2 : 64;
+  TableEntry* entries  = calloc(capacity, sizeof(TableEntry));
+
+  for (NUM i = 0; i < table->TableCapacity; i++) {
+    TableEntry* old = &table->TableEntries[i];
+    if (old->EntryKey) *FindEntry(entries, capacity, old->EntryKey) = *old;
+  }
+
+  free(table->TableEntries);
+  table->TableEntries  = entries;
+  table->TableCapacity = capacity;
+}
+
+void* TableGet(Table* table, const char* key) {
+  if (!table->TableCount) return NULL;
+  return FindEntry(table->TableEntries, table->TableCapacity, key)->EntryValue;
+}
+
+// Returns FALSE and keeps the existing value if the key is already present
+BOOL TablePut(Table* table, const char* key, void* value) {
+  if ((table->TableCount + 1) * 2 > table->TableCapacity) Grow(table);
+
+  TableEntry* entry = FindEntry(table->TableEntries, table->TableCapacity, key);
+  if (entry->EntryKey) return FALSE;
+
+  entry->EntryKey   = key;
+  entry->EntryValue = value;
+  table->TableCount++;
+  return TRUE;
+}
+
+// Empties the table but keeps its storage for reuse
+void TableClear(Table* table) {
+  if (table->TableCount) memset(table->TableEntries, 0, table->TableCapacity * sizeof(TableEntry));
+  table->TableCount = 0;
+}
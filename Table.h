@@ -0,0 +1,19 @@
+#pragma once
+#include "Common.h"
+
+// Open-addressing hash table from interned names (see Intern.h) to pointers.
+// Keys are compared by address, never by contents.
+typedef struct TableEntry {
+  const char* EntryKey;
+  void* EntryValue;
+} TableEntry;
+
+typedef struct Table {
+  TableEntry* TableEntries;
+  NUM TableCapacity;
+  NUM TableCount;
+} Table;
+
+void* TableGet(Table* table, const char* key);
+BOOL TablePut(Table* table, const char* key, void* value);
+void TableClear(Table* table);
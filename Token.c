@@ -1,24 +1,23 @@
 #include "Token.h"
 
-TokenType Peek(Cons** tokens) {
-  if (!(*tokens)) return TOK_NONE;
-  Token* t = (*tokens)->Value;
-  return t->TokenType;
+TokenType Peek(TokenStream* stream) {
+  return PeekN(stream, 0);
 }
 
+// The type of the token n after the current one, TOK_NONE past the end
+TokenType PeekN(TokenStream* stream, NUM n) {
+  if (stream->StreamPosition + n >= stream->StreamCount) return TOK_NONE;
+  return stream->StreamTokens[stream->StreamPosition + n].TokenType;
+}
 
-Token* Pop1(Cons** tokens) {
-  if (!(*tokens)) return NULL;
-
-  Token* tok = (*tokens)->Value;
-  *tokens    = (*tokens)->Tail;
 
-  return tok;
+Token* Pop1(TokenStream* stream) {
+  if (stream->StreamPosition >= stream->StreamCount) return NULL;
+  return &stream->StreamTokens[stream->StreamPosition++];
 }
 
-Token* Expect1(Cons** tokens, TokenType tt) {
-  Token* t = Pop1(tokens);
+Token* Expect1(TokenStream* stream, TokenType tt) {
+  Token* t = Pop1(stream);
   if (!t || t->TokenType != tt) return NULL;
   return t;
 }
-
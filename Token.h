@@ -21,6 +21,9 @@ enum TokenTypeEnum {
   TOK_DOUBLE_AND = 206,
   TOK_DOUBLE_OR = 207,
   TOK_ARROW = 208,
+  TOK_SHIFT_LEFT = 209,
+  TOK_SHIFT_RIGHT = 210,
+  TOK_LOGICAL_SHIFT_RIGHT = 211,
 
   // keywords
   TOK_CONST = 1000,
@@ -36,35 +39,66 @@ enum TokenTypeEnum {
   TOK_SET8 = 1010,
   TOK_BREAK = 1011,
   TOK_CONTINUE = 1012,
+  TOK_INLINE = 1013,
 
   // pseudo tokens
   TOK_INFER_KEYWORD_OR_IDENTIFIER = 2000,
 };
 typedef NUM TokenType;
 
+// Tokens point into the source buffer instead of owning a copy of their text, so Str is
+// not NUL terminated. Identifiers are the exception, Str is their atom (see Intern.h).
 typedef struct Token {
   TokenType TokenType;
-  char* Str;
-  NUM TokenNumber;
+  const char* Str;
+  union {
+    NUM TokenLength;
+    NUM TokenNumber; // TOK_NUMBER
+  };
 } Token;
 
-TokenType Peek(Cons** tokens);
-Token* Pop1(Cons** tokens);
-Token* Expect1(Cons** tokens, TokenType tt);
-Cons* LexFile(char* file);
+// Tokens packed back to back
+typedef struct TokenArray {
+  Token* Tokens;
+  NUM TokensCount;
+  NUM TokensCapacity;
+} TokenArray;
+
+// The parser's cursor into a TokenArray. Saving and restoring StreamPosition backtracks.
+typedef struct TokenStream {
+  Token* StreamTokens;
+  NUM StreamCount;
+  NUM StreamPosition;
+} TokenStream;
+
+TokenType Peek(TokenStream* stream);
+TokenType PeekN(TokenStream* stream, NUM n);
+Token* Pop1(TokenStream* stream);
+Token* Expect1(TokenStream* stream, TokenType tt);
+// Lexes a file one top-level declaration at a time (Lex.k)
+typedef struct Lexer {
+  const char* LexerFile;
+  NUM LexerLength;
+  NUM LexerOffset;
+  char* LexerClasses;
+  TokenArray* LexerTokens;
+} Lexer;
+
+Lexer* MakeLexer(const char* file, NUM length);
+TokenArray* LexDeclaration(Lexer* lexer);
 
 #ifdef DEBUG_TOKENS
 #define Pop(tokens)                                                                                          \
   ({                                                                                                         \
     Token* tok = Pop1(tokens);                                                                               \
-    printf("Line %4d: Pop %s\n", __LINE__, tok->Str);                                                        \
+    printf("Line %4d: Pop %.*s\n", __LINE__, (int)tok->TokenLength, tok->Str);                               \
     tok;                                                                                                     \
   })
 
 #define Expect(tokens, b)                                                                                    \
   ({                                                                                                         \
     Token* tok = Expect1(tokens, b);                                                                         \
-    printf("Line %4d: Expect %s\n", __LINE__, tok->Str);                                                     \
+    printf("Line %4d: Expect %.*s\n", __LINE__, (int)tok->TokenLength, tok->Str);                            \
     tok;                                                                                                     \
   })
 #else
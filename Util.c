@@ -1,30 +1,36 @@
 #include "Util.h"
-#include <stdio.h>
-#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-char* ReadFile(const char* filename) {
-  FILE* f = fopen(filename, "r");
-  if (!f) {
+// Maps filename read-only. The mapping is never unmapped, tokens point into it
+// for the whole compile. The contents are not NUL terminated, use length.
+const char* MapFile(const char* filename, NUM* length) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
     return 0;
   }
 
-  if (fseek(f, 0, SEEK_END) < 0) {
-    fclose(f);
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
     return 0;
   }
-    
-  long length = ftell(f);
 
-  char* ptr = (char*)malloc(length + 1);
-  if (!ptr) {
-    fclose(f);
+  *length = st.st_size;
+
+  // mmap can't map nothing
+  if (*length == 0) {
+    close(fd);
+    return "";
+  }
+
+  void* ptr = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
     return 0;
   }
 
-  ptr[length] = 0;
-      
-  rewind(f);
-  fread(ptr, 1, length, f);
-  fclose(f);
   return ptr;
 }
@@ -1,3 +1,4 @@
 #pragma once
+#include "Common.h"
 
-char* ReadFile(const char* filename);
+const char* MapFile(const char* filename, NUM* length);
@@ -6,7 +6,11 @@ fi
 
 echo Building with KC=$KC
 
-${KC} *.k > k.asm || exit 1
-nasm -felf64 k.asm -o k.o || exit 1
+if [ $KC == ./compiler ]; then
+    ${KC} *.k -o k.o || exit 1
+else
+    ${KC} *.k > k.asm || exit 1
+    nasm -felf64 k.asm -o k.o || exit 1
+fi
 
-gcc -g *.c k.o -o compiler -no-pie
+gcc -g *.c k.o -o compiler -no-pie -lpthread
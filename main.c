@@ -1,17 +1,114 @@
+#include <pthread.h>
+
 #include "Common.h"
 #include "Cons.h"
 #include "Token.h"
 #include "Node.h"
 #include "Util.h"
 #include "ProgramData.h"
+#include "Intern.h"
+#include "Arena.h"
+#include "IR.h"
+
+// Lowers and generates fn right away when everything it refers to has been declared,
+// otherwise keeps it for the end. Returns FALSE if fn was kept.
+static BOOL StreamFunction(Fn* fn, BOOL fold) {
+  if (!CanLowerFn(fn)) {
+    BOOL was_permanent = SetArenaPermanent(TRUE);
+    Push(&Functions, fn);
+    SetArenaPermanent(was_permanent);
+    return FALSE;
+  }
+
+  SetArenaPhase(PHASE_CODEGEN);
+  if (fold) FoldFunction(fn);
+  CodegenFunction(fn);
+  return TRUE;
+}
+
+// Lexes and parses a file into declarations one top level declaration at a time, so that
+// the token array only ever holds a single declaration. When streaming, each declaration
+// is merged into the program right away and functions are generated as soon as they're
+// parsed, after which their AST and IR are thrown away. Returns NULL or what went wrong.
+static const char* CompileFile(const char* path, Declarations* declarations, BOOL stream, BOOL fold) {
+  NUM length;
+  const char* file = MapFile(path, &length);
+  if (!file) return "Failed to open file";
+
+  Lexer* lexer = MakeLexer(file, length);
+  while (TRUE) {
+    ArenaMark mark = MarkArena();
+
+    SetArenaPhase(PHASE_LEX);
+    TokenArray* tokens = LexDeclaration(lexer);
+    if (!tokens) return "Lex error";
+    if (tokens->TokensCount == 0) break;
+
+    SetArenaPhase(PHASE_PARSE);
+    if (!ParseFile(tokens, declarations)) return "Parse error";
+
+    if (stream) {
+      Cons* fn                        = declarations->DeclaredFunctions.ListHead;
+      declarations->DeclaredFunctions = (ConsList){ NULL };
+      MergeDeclarations(declarations);
+      if (!fn || StreamFunction(fn->Value, fold)) ReleaseArena(mark);
+    }
+  }
+
+  // The AST doesn't point into the token array
+  free(lexer->LexerTokens->Tokens);
+  return NULL;
+}
+
+// Files shared out between the -j workers
+typedef struct ParseJobs {
+  const char** JobsFiles;
+  NUM JobsCount;
+  NUM JobsNext; // the next file to be taken, incremented atomically
+  Declarations* JobsDeclarations;
+  const char** JobsErrors;
+} ParseJobs;
+
+static void* ParseWorker(void* argument) {
+  ParseJobs* jobs = argument;
+  while (TRUE) {
+    NUM i = __atomic_fetch_add(&jobs->JobsNext, 1, __ATOMIC_RELAXED);
+    if (i >= jobs->JobsCount) break;
+    jobs->JobsErrors[i] = CompileFile(jobs->JobsFiles[i], &jobs->JobsDeclarations[i], FALSE, FALSE);
+  }
+
+  MergeArenaStats();
+  return NULL;
+}
 
 int main(int argc, const char** argv) {
   if (argc < 2) {
-    fprintf(stderr, "Usage: %s INPUT_FILES > k.asm\n", argv[0]);
+    fprintf(stderr,
+            "Usage: %s [-ast | -ir | -run FN | -S [-comments]] [-no-fold] [-no-inline] [-no-peephole] "
+            "[-peephole-stats] [-frame-pointers] [-mem-stats] [-stream | -j N] [-o k.o] INPUT_FILES\n",
+            argv[0]);
     return 1;
   }
 
-  BOOL print_ast = FALSE;
+  BOOL print_ast      = FALSE;
+  BOOL mem_stats      = FALSE;
+  BOOL print_ir       = FALSE;
+  BOOL fold           = TRUE;
+  BOOL print_asm      = FALSE;
+  BOOL stream         = FALSE;
+  BOOL comments       = FALSE;
+  BOOL frame_pointers = FALSE;
+  BOOL inline_calls   = TRUE;
+  BOOL peephole       = TRUE;
+  BOOL peephole_stats = FALSE;
+  NUM jobs            = 1;
+  const char* run_fn      = NULL;
+  const char* object_path = "k.o";
+
+  const char* files[argc];
+  NUM files_count = 0;
+
+  InitAtoms();
 
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-ast") == 0) {
@@ -20,35 +117,140 @@ int main(int argc, const char** argv) {
 
       }
 
-    char* file = ReadFile(argv[i]);
-    if (!file) {
-      fprintf(stderr, "%s: Failed to open file\n", argv[i]);
-      return 1;
+    if (strcmp(argv[i], "-mem-stats") == 0) {
+      mem_stats = TRUE;
+      continue;
     }
 
-    Cons* tokens = LexFile(file);
-    if (!tokens) {
-      fprintf(stderr, "%s: Lex error\n", argv[i]);
-      return 1;
+    if (strcmp(argv[i], "-no-fold") == 0) {
+      fold = FALSE;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-no-inline") == 0) {
+      inline_calls = FALSE;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-no-peephole") == 0) {
+      peephole = FALSE;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-peephole-stats") == 0) {
+      peephole_stats = TRUE;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-ir") == 0) {
+      print_ir = TRUE;
+      continue;
     }
-    
-    if (!ParseFile(tokens)) {
-      fprintf(stderr, "%s: Parse error\n", argv[i]);
+
+    if (strcmp(argv[i], "-S") == 0) {
+      print_asm = TRUE;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-comments") == 0) {
+      comments = TRUE;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-frame-pointers") == 0) {
+      frame_pointers = TRUE;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-stream") == 0) {
+      stream = TRUE;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      jobs = atol(argv[++i]);
+      continue;
+    }
+
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      object_path = argv[++i];
+      continue;
+    }
+
+    if (strcmp(argv[i], "-run") == 0 && i + 1 < argc) {
+      run_fn = argv[++i];
+      continue;
+    }
+
+    files[files_count++] = argv[i];
+  }
+
+  // -ast, -ir and -run need the whole program, so they never stream
+  BOOL generate = !print_ast && !print_ir && !run_fn;
+  if (!generate) stream = FALSE;
+  // Inlining needs every function, which streaming throws away once it's generated
+  CodegenOptions options = {
+    print_asm ? NULL : object_path, jobs, comments, frame_pointers, inline_calls && !stream, peephole,
+  };
+  if (generate) BeginCodegen(&options);
+
+  Declarations declarations[files_count];
+  const char* errors[files_count];
+  memset(declarations, 0, sizeof(declarations));
+  memset(errors, 0, sizeof(errors));
+
+  // Files are parsed in parallel into their own declarations, which are merged in
+  // command line order, so -j gives the same output as parsing them one by one
+  if (jobs > 1 && !stream) {
+    if (jobs > files_count) jobs = files_count;
+
+    ParseJobs parse_jobs = { files, files_count, 0, declarations, errors };
+    pthread_t threads[jobs];
+    for (NUM i = 0; i < jobs; i++)
+      pthread_create(&threads[i], NULL, ParseWorker, &parse_jobs);
+    for (NUM i = 0; i < jobs; i++)
+      pthread_join(threads[i], NULL);
+  }
+
+  for (NUM i = 0; i < files_count; i++) {
+    if (jobs <= 1 || stream) errors[i] = CompileFile(files[i], &declarations[i], stream, fold);
+    if (errors[i]) {
+      fprintf(stderr, "%s: %s\n", files[i], errors[i]);
       return 1;
     }
+    MergeDeclarations(&declarations[i]);
   }
 
+  // When streaming, only the functions that had to wait are left
+  if (fold) FoldConstants();
+
   if (print_ast) {
-    Cons* fn = Functions;
+    Cons* fn = Functions.ListHead;
     while (fn) {
-      PrintNode(fn->Value, 0);
+      PrintNode(stdout, fn->Value, 0);
       printf("\n\n");
       fn = fn->Tail;
     }
   }
+  else if (print_ir) {
+    SetArenaPhase(PHASE_CODEGEN);
+    Cons* fn = Functions.ListHead;
+    while (fn) {
+      PrintIrFn(LowerFn(fn->Value));
+      fn = fn->Tail;
+    }
+  }
+  else if (run_fn) {
+    SetArenaPhase(PHASE_CODEGEN);
+    return InterpretProgram(run_fn);
+  }
   else {
-    GlobalCodegen();
+    SetArenaPhase(PHASE_CODEGEN);
+    FinishCodegen();
   }
 
+  if (mem_stats) PrintArenaStats();
+  if (peephole_stats) PrintPeepholeStats();
+
   return 0;
 }